@@ -10,6 +10,9 @@
 typedef boost::shared_ptr<Calibrate> CalibratePtr;
 typedef boost::shared_ptr<const Calibrate> CalibrateConstPtr;
 
+// run() and the tone steps write per-frame members (gains_, x_, grad_, res,
+// output), so a Composition composes one frame at a time. Compose frames
+// concurrently with one Composition per thread.
 class Composition
 {
 public:
@@ -1,5 +1,7 @@
 #ifndef SAURON_UTIL_VIDEO_ENCODING_H_
 #define SAURON_UTIL_VIDEO_ENCODING_H_
+#include <stdlib.h>
+#include <functional>
 #include <string>
 
 extern "C" {
@@ -9,134 +11,75 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 #include "opencv2/opencv.hpp"
+#include "ffmpeg_video_encoder.h"
+#include "image_prefetcher.h"
 
 using namespace std;
 using namespace cv;
 
 #pragma warning(disable: 4996)
 
-bool videoEncoding(vector<string>& imgs_names, Size output_size, const char * output_file)
-{
-	// Setting ffmpeg informations
-	AVFormatContext  *pFormatCtxE;
-	AVOutputFormat   *pOutFmtE;
-	AVStream         *pStreamE;
-	AVCodecContext   *pCodecCtxE;
-	AVCodec          *pCodecE;
-	AVFrame          *pYUVFrameE;
-	AVFrame          *pRGBFrameE;
-	SwsContext       *pSWSCtxE;
-	AVPacket          packet;
-
-	int nWidth  = output_size.width;
-	int nHeight = output_size.height;
-	int nByte = nWidth*nHeight * 3;
-
-	av_register_all();
-	avformat_alloc_output_context2(&pFormatCtxE, NULL, NULL, output_file);
-	pOutFmtE = pFormatCtxE->oformat;
-	if (avio_open(&pFormatCtxE->pb, output_file, AVIO_FLAG_READ_WRITE) < 0)
-	{
-		printf("error: cannot OPEN Format Context...\n");
-		return 0;
-	}
+// Supplies the frames to encode, one per call. Returns false once there are
+// no more frames.
+typedef std::function<bool(Mat& frame)> FrameSource;
 
-	pStreamE = avformat_new_stream(pFormatCtxE, 0);
-	if (pStreamE == NULL)
-	{
-		printf("error : cannot Open Stream...\n");
+// Encodes the frames returned by next_frame, resized to output_size, into
+// output_file. Frames are handed to FFMPEGVideoEncoder as they come, encoding
+// runs concurrently with next_frame.
+inline bool videoEncoding(FrameSource next_frame, Size output_size, const char * output_file,
+	const FFMPEGVideoEncoderOptions& options = FFMPEGVideoEncoderOptions())
+{
+	FFMPEGVideoEncoder encoder;
+	if (!encoder.Open(output_file, output_size, options))
 		return false;
-	}
-
-	pCodecCtxE = pStreamE->codec;
-	pCodecCtxE->codec_id = pOutFmtE->video_codec;
-	pCodecCtxE->codec_type = AVMEDIA_TYPE_VIDEO;
-	pCodecCtxE->pix_fmt = AV_PIX_FMT_YUV420P;
-	pCodecCtxE->width = nWidth;
-	pCodecCtxE->height = nHeight;
-	pCodecCtxE->time_base.num = 1;
-	pCodecCtxE->time_base.den = 30;
-	pCodecCtxE->bit_rate = 400000000;
-	pCodecCtxE->gop_size = 25;
-	pCodecCtxE->qmin = 10;
-	pCodecCtxE->qmax = 51;
-	pCodecCtxE->sample_aspect_ratio.num = 1; // nWidth;
-	pCodecCtxE->sample_aspect_ratio.den = 1; // nHeight;
 
-	pSWSCtxE = sws_getContext(nWidth, nHeight, AV_PIX_FMT_BGR24, nWidth, nHeight, AV_PIX_FMT_YUV420P, SWS_POINT, NULL, NULL, NULL);
-	pRGBFrameE = new AVFrame[1];
-	pYUVFrameE = new AVFrame[1];
-	uint8_t* rgb_buff = new uint8_t[nByte];
-	uint8_t* yuv_buff = new uint8_t[nByte / 2];
-
-	pCodecE = avcodec_find_encoder(pCodecCtxE->codec_id);
-	if (!pCodecE)
-	{
-		printf("error 9: cannot FIND Encoder...\n");
-		return 0;
-	}
-	if (avcodec_open2(pCodecCtxE, pCodecE, NULL) < 0)
+	Mat image;
+	while (next_frame(image))
 	{
-		printf("error : cannot OPEN Encoder");
-		return 0;
-	}
-
-	// Begin Encoding.
-	av_new_packet(&packet, nByte);
-	avformat_write_header(pFormatCtxE, NULL);
-	
-	avpicture_fill((AVPicture*)pRGBFrameE, rgb_buff, AV_PIX_FMT_RGB24, nWidth, nHeight);
-	avpicture_fill((AVPicture*)pYUVFrameE, yuv_buff, AV_PIX_FMT_YUV420P, nWidth, nHeight);
-
-
-	for (int i = 0; i<imgs_names.size(); ++i)
-	{	
-		printf("Load img: %d: %s...\n", i, imgs_names[i].c_str());
-		Mat3b image = imread(imgs_names[i]);
-		resize(image, image, output_size);	
-		memcpy(rgb_buff, (uint8_t*)image.data, nByte * sizeof(uint8_t));
-
-		pYUVFrameE->width = nWidth;
-		pYUVFrameE->height = nHeight;
-		sws_scale(pSWSCtxE, pRGBFrameE->data, pRGBFrameE->linesize, 0, nHeight, 
-			pYUVFrameE->data, pYUVFrameE->linesize);
-		pYUVFrameE->pts = i;
-
-		int got_picture = 0;
-		printf("Encoding frame %d ...\n", i);
-		int ret = avcodec_encode_video2(pCodecCtxE, &packet, pYUVFrameE, &got_picture);
-		if (ret < 0)
+		if (!encoder.Push(image))
 		{
 			printf("error : failing in encoder...\n");
-			return 0;
-		}
-		if (got_picture == 1)
-		{
-			packet.stream_index = pStreamE->index;
-			ret = av_write_frame(pFormatCtxE, &packet);
-			av_free_packet(&packet);
-			av_new_packet(&packet, nByte);
-			printf("Writing frame...\n");
+			encoder.Flush();
+			return false;
 		}
 	}
-	av_free_packet(&packet);
-	av_write_trailer(pFormatCtxE);
+	bool ok = encoder.Flush();
 	printf("Finishing encodeing...\n");
-	sws_freeContext(pSWSCtxE);
-	delete[] rgb_buff;
-	delete[] yuv_buff;
-	rgb_buff = NULL;
-	yuv_buff = NULL;
-	delete pRGBFrameE;
-	delete pYUVFrameE;
+	return ok;
+}
 
-	avcodec_close(pCodecCtxE);
-	avformat_close_input(&pFormatCtxE);
-	return true;
+bool videoEncoding(vector<string>& imgs_names, Size output_size, const char * output_file,
+	const FFMPEGVideoEncoderOptions& options = FFMPEGVideoEncoderOptions())
+{
+	// Images are decoded and resized ahead on a few threads while the
+	// previous ones are being encoded.
+	ImagePrefetcher prefetcher;
+	prefetcher.Start(imgs_names, 0, 8, output_size);
+	size_t i = 0;
+	bool ok = videoEncoding([&](Mat& frame) {
+		if (i >= imgs_names.size())
+			return false;
+		printf("Load img: %d: %s...\n", (int)i, imgs_names[i].c_str());
+		++i;
+		return prefetcher.Next(frame);
+	}, output_size, output_file, options);
+	// An unreadable image ends the source early, the video is then truncated.
+	if (prefetcher.failed())
+	{
+		printf("error : video truncated at image %d\n", (int)i - 1);
+		return false;
+	}
+	return ok;
 }
 
 
-bool convert2MP4(const char* input_h264, const char* output_video)
+// Remuxes the raw streams in input_h264 one after the other into
+// output_video, with timestamps continuing across inputs. All inputs must
+// have been encoded with the same settings. If audio_source is not empty, its
+// first audio stream is copied alongside from audio_offset seconds on, as
+// FFMPEGVideoEncoderOptions::audio_source does for a single encode.
+inline bool convert2MP4(const vector<string>& input_h264, const char* output_video,
+	const string& audio_source = string(), double audio_offset = 0.0)
 {
 	AVOutputFormat *ofmt = NULL;
 	AVFormatContext *ifmt_ctx_v = NULL, *ofmt_ctx = NULL;
@@ -147,9 +90,11 @@ bool convert2MP4(const char* input_h264, const char* output_video)
 	int frame_index = 0;
 
 	av_register_all();
+	if (input_h264.empty())
+		return false;
 
 	//���루Input��
-	if ((ret = avformat_open_input(&ifmt_ctx_v, input_h264, 0, 0)) < 0) {
+	if ((ret = avformat_open_input(&ifmt_ctx_v, input_h264[0].c_str(), 0, 0)) < 0) {
 		printf("Could not open input file.");
 		return false;
 	}
@@ -190,6 +135,76 @@ bool convert2MP4(const char* input_h264, const char* output_video)
 		}
 	}
 
+	// Audio passthrough, audio_ctx is NULL when disabled.
+	AVFormatContext *audio_ctx = NULL;
+	AVStream *audio_in = NULL, *audio_out = NULL;
+	int64_t audio_start = 0;
+	if (!audio_source.empty())
+	{
+		if (avformat_open_input(&audio_ctx, audio_source.c_str(), 0, 0) < 0 ||
+			avformat_find_stream_info(audio_ctx, 0) < 0) {
+			printf("Could not open audio source %s\n", audio_source.c_str());
+			return false;
+		}
+		int audio_index = av_find_best_stream(audio_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+		if (audio_index < 0) {
+			printf("No audio stream in %s\n", audio_source.c_str());
+			avformat_close_input(&audio_ctx);
+			return false;
+		}
+		audio_in = audio_ctx->streams[audio_index];
+		audio_out = avformat_new_stream(ofmt_ctx, NULL);
+		if (!audio_out || avcodec_parameters_copy(audio_out->codecpar, audio_in->codecpar) < 0) {
+			printf("Failed allocating audio stream\n");
+			avformat_close_input(&audio_ctx);
+			return false;
+		}
+		audio_out->codecpar->codec_tag = 0;
+		audio_out->time_base = audio_in->time_base;
+		audio_start = (audio_in->start_time != AV_NOPTS_VALUE ? audio_in->start_time : 0) +
+			av_rescale_q((int64_t)(audio_offset * AV_TIME_BASE), AV_TIME_BASE_Q, audio_in->time_base);
+		if (audio_offset > 0)
+			av_seek_frame(audio_ctx, audio_index, audio_start, AVSEEK_FLAG_BACKWARD);
+	}
+	// Copies the source audio up to time (seconds of output), so that audio
+	// and video stay interleaved. A packet read past time waits for the next
+	// call.
+	AVPacket audio_pkt;
+	av_init_packet(&audio_pkt);
+	audio_pkt.data = NULL;
+	audio_pkt.size = 0;
+	bool audio_pending = false;
+	auto copyAudioUntil = [&](double time) -> bool {
+		while (audio_ctx)
+		{
+			if (!audio_pending)
+			{
+				if (av_read_frame(audio_ctx, &audio_pkt) < 0)
+					return true;
+				if (audio_pkt.stream_index != audio_in->index ||
+					audio_pkt.pts == AV_NOPTS_VALUE || audio_pkt.pts < audio_start) {
+					av_packet_unref(&audio_pkt);
+					continue;
+				}
+				audio_pkt.pts -= audio_start;
+				if (audio_pkt.dts != AV_NOPTS_VALUE)
+					audio_pkt.dts -= audio_start;
+				audio_pending = true;
+			}
+			if (audio_pkt.pts * av_q2d(audio_in->time_base) > time)
+				return true;
+			av_packet_rescale_ts(&audio_pkt, audio_in->time_base, audio_out->time_base);
+			audio_pkt.stream_index = audio_out->index;
+			audio_pkt.pos = -1;
+			audio_pending = false;
+			if (av_interleaved_write_frame(ofmt_ctx, &audio_pkt) < 0) {
+				printf("Error muxing audio packet\n");
+				return false;
+			}
+		}
+		return true;
+	};
+
 	//������ļ���Open output file��
 	if (!(ofmt->flags & AVFMT_NOFILE)) {
 		if (avio_open(&ofmt_ctx->pb, output_video, AVIO_FLAG_WRITE) < 0) {
@@ -209,38 +224,74 @@ bool convert2MP4(const char* input_h264, const char* output_video)
 	ifmt_ctx = ifmt_ctx_v;
 	stream_index = videoindex_out;
 
-	while (av_read_frame(ifmt_ctx, &pkt)>=0)
+	for (size_t input = 0; input < input_h264.size(); ++input)
 	{
-		in_stream = ifmt_ctx->streams[pkt.stream_index];
-		out_stream = ofmt_ctx->streams[stream_index];
-
-		//Write PTS
-		AVRational time_base1 = in_stream->time_base;
-		//Duration between 2 frames (us)
-		int64_t calc_duration = (double)AV_TIME_BASE / av_q2d(in_stream->r_frame_rate);
-		//Parameters
-		pkt.pts = (double)(frame_index*calc_duration) / (double)(av_q2d(time_base1)*AV_TIME_BASE);
-		pkt.dts = pkt.pts;
-		pkt.duration = (double)calc_duration / (double)(av_q2d(time_base1)*AV_TIME_BASE);
-		frame_index++;
+		// The first input is already open, it also provided the codec settings.
+		if (input > 0)
+		{
+			avformat_close_input(&ifmt_ctx_v);
+			if (avformat_open_input(&ifmt_ctx_v, input_h264[input].c_str(), 0, 0) < 0 ||
+				avformat_find_stream_info(ifmt_ctx_v, 0) < 0) {
+				printf("Could not open input file %s.\n", input_h264[input].c_str());
+				ret = -1;
+				break;
+			}
+			ifmt_ctx = ifmt_ctx_v;
+		}
 
-		/* copy packet */
-		//ת��PTS/DTS��Convert PTS/DTS��
-		pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-		pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-		pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
-		pkt.pos = -1;
-		pkt.stream_index = stream_index;
+		while (av_read_frame(ifmt_ctx, &pkt)>=0)
+		{
+			in_stream = ifmt_ctx->streams[pkt.stream_index];
+			out_stream = ofmt_ctx->streams[stream_index];
+
+			//Write PTS
+			AVRational time_base1 = in_stream->time_base;
+			//Duration between 2 frames (us)
+			int64_t calc_duration = (double)AV_TIME_BASE / av_q2d(in_stream->r_frame_rate);
+			//Parameters
+			pkt.pts = (double)(frame_index*calc_duration) / (double)(av_q2d(time_base1)*AV_TIME_BASE);
+			pkt.dts = pkt.pts;
+			pkt.duration = (double)calc_duration / (double)(av_q2d(time_base1)*AV_TIME_BASE);
+			if (!copyAudioUntil((double)frame_index * calc_duration / AV_TIME_BASE)) {
+				av_free_packet(&pkt);
+				ret = -1;
+				break;
+			}
+			frame_index++;
+
+			/* copy packet */
+			//ת��PTS/DTS��Convert PTS/DTS��
+			pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+			pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+			pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
+			pkt.pos = -1;
+			pkt.stream_index = stream_index;
+
+			printf("Write 1 Packet. size:%5d\tpts:%8d\n", pkt.size, pkt.pts);
+			//д�루Write��
+			if (av_interleaved_write_frame(ofmt_ctx, &pkt) < 0) {
+				printf("Error muxing packet\n");
+				break;
+			}
+			av_free_packet(&pkt);
 
-		printf("Write 1 Packet. size:%5d\tpts:%8d\n", pkt.size, pkt.pts);
-		//д�루Write��
-		if (av_interleaved_write_frame(ofmt_ctx, &pkt) < 0) {
-			printf("Error muxing packet\n");
-			break;
 		}
-		av_free_packet(&pkt);
-
+		if (ret < 0)
+			break;
 	}
+	// Audio runs until the end of the last frame.
+	if (ret >= 0 && audio_ctx && frame_index > 0)
+	{
+		AVStream *video_in = ifmt_ctx_v->streams[videoindex_v];
+		double frame_duration = 1.0 / av_q2d(video_in->r_frame_rate);
+		if (!copyAudioUntil(frame_index * frame_duration))
+			ret = -1;
+	}
+	if (audio_pending)
+		av_packet_unref(&audio_pkt);
+	if (audio_ctx)
+		avformat_close_input(&audio_ctx);
+
 	//д�ļ�β��Write file trailer��
 	av_write_trailer(ofmt_ctx);
 	avformat_close_input(&ifmt_ctx_v);
@@ -257,8 +308,62 @@ bool convert2MP4(const char* input_h264, const char* output_video)
 	return true;
 }
 
+bool convert2MP4(const char* input_h264, const char* output_video)
+{
+	return convert2MP4(vector<string>(1, input_h264), output_video);
+}
+
+// Parses the encoder flags of the Image2Video tool into options:
+//   --threads=N --preset=NAME --crf=N --bitrate=BPS --gop=N --bframes=N --fps=F
+//   --audio=FILE --audio-offset=SECONDS
+// Passing --bitrate selects average bit rate mode instead of constant
+// quality. --audio copies the audio track of FILE into the output, starting
+// --audio-offset seconds in. Returns the remaining arguments, argv[0]
+// excluded, in order.
+inline vector<string> parseEncoderOptions(int argc, char** argv, FFMPEGVideoEncoderOptions* options)
+{
+	vector<string> positional;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0 || eq == string::npos)
+		{
+			positional.push_back(arg);
+			continue;
+		}
+		string name = arg.substr(2, eq - 2);
+		string value = arg.substr(eq + 1);
+		if (name == "threads")
+			options->thread_count = atoi(value.c_str());
+		else if (name == "preset")
+			options->preset = value;
+		else if (name == "crf")
+			options->crf = atoi(value.c_str());
+		else if (name == "bitrate")
+		{
+			options->bit_rate = atoll(value.c_str());
+			options->crf = -1;
+		}
+		else if (name == "gop")
+			options->gop_size = atoi(value.c_str());
+		else if (name == "bframes")
+			options->max_b_frames = atoi(value.c_str());
+		else if (name == "fps")
+			options->frame_rate = atof(value.c_str());
+		else if (name == "audio")
+			options->audio_source = value;
+		else if (name == "audio-offset")
+			options->audio_offset = atof(value.c_str());
+		else
+			printf("warning: unknown option %s\n", arg.c_str());
+	}
+	return positional;
+}
+
 bool Image2Video(const char* input_path, int start_id, int image_num,
-	const char* output_path, const char* output_name, Size output_size, std::vector<string>& imgs_names)
+	const char* output_path, const char* output_name, Size output_size, std::vector<string>& imgs_names,
+	const FFMPEGVideoEncoderOptions& options = FFMPEGVideoEncoderOptions())
 {
 	// vector<string> imgs_names;
 	// imgs_names.resize(image_num);
@@ -270,17 +375,10 @@ bool Image2Video(const char* input_path, int start_id, int image_num,
 		imgs_names[i] = input_dir + "/" + imgs_names[i];
 	}
 
-	bool run_flag;
-	// 1. image to h264;
-	string temp(output_path);
-	temp += "temp.h264";
-	if (!videoEncoding(imgs_names, output_size, temp.c_str()))
-		return false;
-	// 2. h264 to mp4;
-
+	// Frames are encoded and muxed into the target container in one pass.
 	string output(output_path);
 	output += output_name;
-	if (!convert2MP4(temp.c_str(), output.c_str()))
+	if (!videoEncoding(imgs_names, output_size, output.c_str(), options))
 		return false;
 
 	return true;
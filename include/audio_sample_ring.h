@@ -0,0 +1,196 @@
+// Sample conversion and buffering of decoded audio.
+//
+// Decoded audio frames (AVFrame data in S16, S16P, FLT or FLTP) are converted
+// to interleaved float in [-1, 1) and kept in a ring allocated once per
+// stream, so consuming a frame is a copy out of the ring and nothing is
+// reallocated per frame. The S16 and stereo interleave paths use SSE2 when
+// the compiler targets it, which is the default on x86-64; other targets take
+// the scalar loops.
+
+#ifndef AUDIO_SAMPLE_RING_H_
+#define AUDIO_SAMPLE_RING_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include "libavutil/samplefmt.h"
+}
+
+// Converts count signed 16 bit samples to float, scaled by 1/32768.
+inline void ConvertS16ToFloat(const int16_t *in, float *out, int count) {
+    const float scale = 1.0f / 32768.0f;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale4 = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i s16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        // Duplicating each sample into both halves of a 32 bit lane and
+        // shifting right arithmetically sign-extends it.
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s16, s16), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s16, s16), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale4));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale4));
+    }
+#endif
+    for (; i < count; ++i)
+        out[i] = in[i] * scale;
+}
+
+// Interleaves count samples of each of the channels planes into out.
+inline void InterleavePlanarFloat(const float *const *planes, int channels,
+                                  int count, float *out) {
+    int i = 0;
+#ifdef __SSE2__
+    if (channels == 2) {
+        const float *left = planes[0];
+        const float *right = planes[1];
+        for (; i + 4 <= count; i += 4) {
+            __m128 l = _mm_loadu_ps(left + i);
+            __m128 r = _mm_loadu_ps(right + i);
+            _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+        }
+    }
+#endif
+    for (; i < count; ++i)
+        for (int c = 0; c < channels; ++c)
+            out[i * channels + c] = planes[c][i];
+}
+
+// Interleaves count samples of each of the channels 16 bit planes into out,
+// converting them to float.
+inline void InterleavePlanarS16(const int16_t *const *planes, int channels,
+                                int count, float *out) {
+    const float scale = 1.0f / 32768.0f;
+    for (int i = 0; i < count; ++i)
+        for (int c = 0; c < channels; ++c)
+            out[i * channels + c] = planes[c][i] * scale;
+}
+
+// Fixed capacity FIFO of interleaved float samples.
+class AudioSampleRing {
+public:
+    AudioSampleRing()
+        : allocated_(0), capacity_(0), channels_(0), head_(0), size_(0) {}
+
+    // Allocates room for samples samples of each of the channels and empties
+    // the ring. Only reallocates if the capacity grows.
+    void Reserve(int samples, int channels) {
+        const int capacity = samples * channels;
+        if (capacity > allocated_)
+            buffer_.reset(new float[capacity]);
+        allocated_ = std::max(allocated_, capacity);
+        capacity_ = capacity;
+        channels_ = channels;
+        Clear();
+    }
+
+    void Clear() { head_ = 0; size_ = 0; }
+
+    // Number of buffered samples, all channels counted.
+    int size() const { return size_; }
+    int capacity() const { return capacity_; }
+    int space() const { return capacity_ - size_; }
+
+    // Appends samples samples per channel of a decoded frame in format
+    // (AV_SAMPLE_FMT_S16, S16P, FLT or FLTP), converted to interleaved float.
+    // data holds one pointer per plane, as AVFrame::extended_data, with the
+    // channel count given to Reserve(). Returns false, leaving the ring
+    // unchanged, if the format is not supported or the samples do not fit.
+    bool WriteFrame(const uint8_t *const *data, int format, int samples);
+
+    // Copies count samples to out and removes them from the ring. Returns the
+    // number of samples copied, less than count if fewer are buffered.
+    int Read(float *out, int count);
+
+private:
+    // Converts samples [first, first + count) per channel of data into the
+    // ring at position dst.
+    static void Convert(const uint8_t *const *data, int format, int channels,
+                        int first, int count, float *dst);
+
+    std::unique_ptr<float[]> buffer_;
+    int allocated_;
+    // Capacity in use, a multiple of channels_.
+    int capacity_;
+    int channels_;
+    // Position of the oldest sample and number of samples buffered.
+    int head_;
+    int size_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline void AudioSampleRing::Convert(const uint8_t *const *data, int format,
+                                     int channels, int first, int count,
+                                     float *dst) {
+    // Planes offset to the first sample, at most 8 channels.
+    const void *planes[8];
+    switch (format) {
+    case AV_SAMPLE_FMT_S16:
+        ConvertS16ToFloat(reinterpret_cast<const int16_t *>(data[0]) + first * channels,
+                          dst, count * channels);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        memcpy(dst, reinterpret_cast<const float *>(data[0]) + first * channels,
+               count * channels * sizeof(float));
+        break;
+    case AV_SAMPLE_FMT_S16P:
+        for (int c = 0; c < channels; ++c)
+            planes[c] = reinterpret_cast<const int16_t *>(data[c]) + first;
+        InterleavePlanarS16(reinterpret_cast<const int16_t *const *>(planes),
+                            channels, count, dst);
+        break;
+    case AV_SAMPLE_FMT_FLTP:
+        for (int c = 0; c < channels; ++c)
+            planes[c] = reinterpret_cast<const float *>(data[c]) + first;
+        InterleavePlanarFloat(reinterpret_cast<const float *const *>(planes),
+                              channels, count, dst);
+        break;
+    }
+}
+
+inline bool AudioSampleRing::WriteFrame(const uint8_t *const *data, int format,
+                                        int samples) {
+    const int channels = channels_;
+    if (channels <= 0 || channels > 8 ||
+        (format != AV_SAMPLE_FMT_S16 && format != AV_SAMPLE_FMT_S16P &&
+         format != AV_SAMPLE_FMT_FLT && format != AV_SAMPLE_FMT_FLTP) ||
+        samples < 0 || samples * channels > space())
+        return false;
+    // Nothing to write, also the only write an empty ring (capacity_ 0)
+    // accepts.
+    if (samples == 0 || capacity_ == 0)
+        return true;
+
+    // The free space may wrap around the end of the buffer. capacity_ is a
+    // multiple of channels, so no sample straddles the wrap.
+    const int tail = (head_ + size_) % capacity_;
+    const int first_span = std::min(samples, (capacity_ - tail) / channels);
+    Convert(data, format, channels, 0, first_span, buffer_.get() + tail);
+    if (first_span < samples)
+        Convert(data, format, channels, first_span, samples - first_span,
+                buffer_.get());
+    size_ += samples * channels;
+    return true;
+}
+
+inline int AudioSampleRing::Read(float *out, int count) {
+    count = std::min(count, size_);
+    int first_span = std::min(count, capacity_ - head_);
+    memcpy(out, buffer_.get() + head_, first_span * sizeof(float));
+    memcpy(out + first_span, buffer_.get(), (count - first_span) * sizeof(float));
+    if (count > 0)
+        head_ = (head_ + count) % capacity_;
+    size_ -= count;
+    return count;
+}
+
+#endif  // AUDIO_SAMPLE_RING_H_
@@ -0,0 +1,256 @@
+#ifndef SAURON_COLOR_TRANSFORM_COLOR_LUT_H_
+#define SAURON_COLOR_TRANSFORM_COLOR_LUT_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+#include "color_transform.h"
+
+// One per-camera color operation, on values in [0, 255] in the channel
+// order of the images.
+struct ColorOp {
+  enum Type {
+    kGain,       // v * gain, all channels.
+    kTransform,  // A * v + transform_scale * b.
+    kGamma,      // 255 * (v / 255)^gamma, per channel.
+  };
+
+  Type type = kGain;
+  double gain = 1.0;
+  ColorTransform<double> transform = {{1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0}};
+  // Value of 1 in the units of transform, see ApplyColorTransform.
+  double transform_scale = 255.0;
+  double gamma = 1.0;
+
+  static ColorOp Gain(double gain) {
+    ColorOp op;
+    op.type = kGain;
+    op.gain = gain;
+    return op;
+  }
+
+  // transform is in units where value_scale is 1: the default of 255
+  // takes the transforms of ColorTransformer, estimated on [0, 1]
+  // images, pass 1 for a transform of [0, 255] values.
+  static ColorOp Transform(const ColorTransform<double>& transform,
+                           double value_scale = 255.0) {
+    CV_Assert(value_scale > 0.0);
+    ColorOp op;
+    op.type = kTransform;
+    op.transform = transform;
+    op.transform_scale = value_scale;
+    return op;
+  }
+
+  static ColorOp Gamma(double gamma) {
+    ColorOp op;
+    op.type = kGamma;
+    op.gamma = gamma;
+    return op;
+  }
+
+  // Applies the operation to v in place.
+  void Apply(double* v) const {
+    switch (type) {
+      case kGain:
+        for (int c = 0; c < 3; ++c) {
+          v[c] *= gain;
+        }
+        break;
+      case kTransform: {
+        double out[3];
+        for (int r = 0; r < 3; ++r) {
+          out[r] = transform_scale * transform.data[9 + r];
+          for (int c = 0; c < 3; ++c) {
+            out[r] += transform.data[c * 3 + r] * v[c];
+          }
+        }
+        memcpy(v, out, sizeof(out));
+        break;
+      }
+      case kGamma:
+        for (int c = 0; c < 3; ++c) {
+          v[c] = 255.0 * pow(std::max(v[c], 0.0) / 255.0, gamma);
+        }
+        break;
+    }
+  }
+};
+
+// A chain of color operations (gains, color transforms, gamma) baked into
+// a size^3 lattice, applied to 8 bit pixels in a single pass with
+// tetrahedral interpolation. Spatially varying corrections such as
+// vignetting or gain maps cannot be baked and stay in the compose
+// weights.
+class ColorLut3D {
+ public:
+  static const int kDefaultSize = 33;
+
+  ColorLut3D() : size_(0) {}
+
+  // Bakes ops, applied in order, into a size^3 lattice.
+  void Build(const std::vector<ColorOp>& ops, int size = kDefaultSize);
+
+  // Rebuilds the lattice only if ops or size differ from the last build.
+  // Returns true if it was rebuilt.
+  bool Update(const std::vector<ColorOp>& ops, int size = kDefaultSize);
+
+  bool empty() const { return size_ == 0; }
+
+  // Maps one pixel, given as three values in [0, 255].
+  void Lookup(const float* in, float* out) const;
+
+  // Maps every pixel of input (CV_8UC3) into output, which may be input.
+  void Apply(const cv::Mat& input, cv::Mat& output) const;
+
+ private:
+  // Parameters of ops, compared by Update().
+  static std::vector<double> Signature(const std::vector<ColorOp>& ops,
+                                       int size);
+
+  // Blends the lattice cell i at fractions f with tetrahedral
+  // interpolation.
+  void Interpolate(const int* i, const float* f, float* out) const;
+
+  const float* Node(int i0, int i1, int i2) const {
+    return &lattice_[((static_cast<size_t>(i2) * size_ + i1) * size_ + i0) * 3];
+  }
+
+  int size_;
+  // Output of node (i0, i1, i2) at ((i2 * size + i1) * size + i0) * 3.
+  std::vector<float> lattice_;
+  std::vector<double> signature_;
+  // Lattice cell and fraction of every 8 bit value.
+  int cell_[256];
+  float fraction_[256];
+};
+
+inline void ColorLut3D::Build(const std::vector<ColorOp>& ops, int size) {
+  size_ = std::max(size, 2);
+  const double step = 255.0 / (size_ - 1);
+  lattice_.resize(static_cast<size_t>(size_) * size_ * size_ * 3);
+  for (int i2 = 0; i2 < size_; ++i2) {
+    for (int i1 = 0; i1 < size_; ++i1) {
+      for (int i0 = 0; i0 < size_; ++i0) {
+        double v[3] = {i0 * step, i1 * step, i2 * step};
+        for (size_t k = 0; k < ops.size(); ++k) {
+          ops[k].Apply(v);
+        }
+        float* node =
+            &lattice_[((static_cast<size_t>(i2) * size_ + i1) * size_ + i0) * 3];
+        for (int c = 0; c < 3; ++c) {
+          node[c] = static_cast<float>(v[c]);
+        }
+      }
+    }
+  }
+  for (int value = 0; value < 256; ++value) {
+    const double position = value / step;
+    cell_[value] = std::min(static_cast<int>(position), size_ - 2);
+    fraction_[value] = static_cast<float>(position - cell_[value]);
+  }
+  signature_ = Signature(ops, size);
+}
+
+inline bool ColorLut3D::Update(const std::vector<ColorOp>& ops, int size) {
+  if (size_ != 0 && Signature(ops, size) == signature_) {
+    return false;
+  }
+  Build(ops, size);
+  return true;
+}
+
+inline std::vector<double> ColorLut3D::Signature(
+    const std::vector<ColorOp>& ops, int size) {
+  std::vector<double> signature(1, size);
+  for (size_t k = 0; k < ops.size(); ++k) {
+    signature.push_back(ops[k].type);
+    signature.push_back(ops[k].gain);
+    signature.push_back(ops[k].gamma);
+    signature.push_back(ops[k].transform_scale);
+    signature.insert(signature.end(), ops[k].transform.data,
+                     ops[k].transform.data + 12);
+  }
+  return signature;
+}
+
+inline void ColorLut3D::Lookup(const float* in, float* out) const {
+  const float scale = (size_ - 1) / 255.0f;
+  int i[3];
+  float f[3];
+  for (int c = 0; c < 3; ++c) {
+    const float position =
+        std::min(std::max(in[c], 0.0f), 255.0f) * scale;
+    i[c] = std::min(static_cast<int>(position), size_ - 2);
+    f[c] = position - i[c];
+  }
+  Interpolate(i, f, out);
+}
+
+inline void ColorLut3D::Interpolate(const int* i, const float* f,
+                                    float* out) const {
+  // The cube is split into six tetrahedra along its main diagonal; the
+  // ordering of the fractions picks the one holding the point, and the
+  // result is the barycentric blend of its four corners.
+  const float* c000 = Node(i[0], i[1], i[2]);
+  const float* c111 = Node(i[0] + 1, i[1] + 1, i[2] + 1);
+  const float *a, *b;
+  float w0, w1, w2, w3;
+  if (f[0] >= f[1]) {
+    if (f[1] >= f[2]) {
+      a = Node(i[0] + 1, i[1], i[2]);
+      b = Node(i[0] + 1, i[1] + 1, i[2]);
+      w0 = 1 - f[0]; w1 = f[0] - f[1]; w2 = f[1] - f[2]; w3 = f[2];
+    } else if (f[0] >= f[2]) {
+      a = Node(i[0] + 1, i[1], i[2]);
+      b = Node(i[0] + 1, i[1], i[2] + 1);
+      w0 = 1 - f[0]; w1 = f[0] - f[2]; w2 = f[2] - f[1]; w3 = f[1];
+    } else {
+      a = Node(i[0], i[1], i[2] + 1);
+      b = Node(i[0] + 1, i[1], i[2] + 1);
+      w0 = 1 - f[2]; w1 = f[2] - f[0]; w2 = f[0] - f[1]; w3 = f[1];
+    }
+  } else {
+    if (f[0] >= f[2]) {
+      a = Node(i[0], i[1] + 1, i[2]);
+      b = Node(i[0] + 1, i[1] + 1, i[2]);
+      w0 = 1 - f[1]; w1 = f[1] - f[0]; w2 = f[0] - f[2]; w3 = f[2];
+    } else if (f[1] >= f[2]) {
+      a = Node(i[0], i[1] + 1, i[2]);
+      b = Node(i[0], i[1] + 1, i[2] + 1);
+      w0 = 1 - f[1]; w1 = f[1] - f[2]; w2 = f[2] - f[0]; w3 = f[0];
+    } else {
+      a = Node(i[0], i[1], i[2] + 1);
+      b = Node(i[0], i[1] + 1, i[2] + 1);
+      w0 = 1 - f[2]; w1 = f[2] - f[1]; w2 = f[1] - f[0]; w3 = f[0];
+    }
+  }
+  for (int c = 0; c < 3; ++c) {
+    out[c] = w0 * c000[c] + w1 * a[c] + w2 * b[c] + w3 * c111[c];
+  }
+}
+
+inline void ColorLut3D::Apply(const cv::Mat& input, cv::Mat& output) const {
+  CV_Assert(input.type() == CV_8UC3 && !empty());
+  output.create(input.size(), CV_8UC3);
+  for (int row = 0; row < input.rows; ++row) {
+    const uint8_t* in = input.ptr<uint8_t>(row);
+    uint8_t* out = output.ptr<uint8_t>(row);
+    for (int col = 0; col < input.cols; ++col, in += 3, out += 3) {
+      // 8 bit inputs use the precomputed cells and fractions.
+      const int i[3] = {cell_[in[0]], cell_[in[1]], cell_[in[2]]};
+      const float f[3] = {fraction_[in[0]], fraction_[in[1]], fraction_[in[2]]};
+      float mapped[3];
+      Interpolate(i, f, mapped);
+      for (int c = 0; c < 3; ++c) {
+        out[c] = cv::saturate_cast<uint8_t>(mapped[c]);
+      }
+    }
+  }
+}
+
+#endif  // SAURON_COLOR_TRANSFORM_COLOR_LUT_H_
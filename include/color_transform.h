@@ -48,6 +48,10 @@ struct ColorTransformOptions {
   double roi_left = 0.4;
   double roi_width = 0.2;
   double roi_height = 0.2;
+
+  // Pixel stride of the subsample the statistics are computed on, in
+  // both directions. 1 uses every pixel.
+  int statistics_stride = 1;
 };
 
 class ColorTransformer {
@@ -82,6 +86,15 @@ public:
   void ColorCorrectImagePairLoop(const ColorTransformOptions& options,
                                  std::vector<cv::Mat3f>& outputs);
 
+  // Applies the transforms estimated by ColorCorrectImagePairLoop, on
+  // values in [0, 1], to 8 bit images in [0, 255], in place, with
+  // saturation. images[i] is corrected by the transform of image i.
+  void ColorCorrectInPlace(std::vector<cv::Mat>& images) const;
+
+  const std::vector<ColorTransform<double>>& transforms() const {
+    return transforms_;
+  }
+
 private:
   void EstimateColorTransforms(const ColorTransformOptions& options);
 
@@ -127,5 +140,38 @@ private:
   std::vector<cv::Mat1b> masks_;
 };
 
+// Applies transform to every pixel of input (CV_8UC3) into output, which
+// may be input itself. Results are rounded and saturated to 8 bit. This
+// goes through cv::transform, whose 8 bit path is vectorized, so it costs
+// about as much as a copy of the image.
+//
+// value_scale is the 8 bit value of 1 in the units transform was
+// estimated in, b is multiplied by it while A is unit free. The
+// transforms of ColorTransformer are estimated on float images in
+// [0, 1], hence the default of 255; pass 1 for a transform of [0, 255]
+// values.
+inline void ApplyColorTransform(const ColorTransform<double>& transform,
+                                const cv::Mat& input, cv::Mat& output,
+                                double value_scale = 255.0) {
+  CV_Assert(input.type() == CV_8UC3);
+  CV_Assert(value_scale > 0.0);
+  // data is the column major [A b], cv::transform wants it row major.
+  cv::Matx34f m;
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) {
+      m(r, c) = static_cast<float>(transform.data[c * 3 + r]);
+    }
+    m(r, 3) = static_cast<float>(value_scale * transform.data[9 + r]);
+  }
+  cv::transform(input, output, m);
+}
+
+inline void ColorTransformer::ColorCorrectInPlace(
+    std::vector<cv::Mat>& images) const {
+  for (size_t i = 0; i < images.size() && i < transforms_.size(); ++i) {
+    ApplyColorTransform(transforms_[i], images[i], images[i]);
+  }
+}
+
 
 #endif // SAURON_COLOR_TRANSFORM_COLOR_TRANSFORMER_H_
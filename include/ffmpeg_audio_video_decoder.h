@@ -3,12 +3,15 @@
 #ifndef FFMPEG_AUDIO_VIDEO_DECODER_H_
 #define FFMPEG_AUDIO_VIDEO_DECODER_H_
 
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 //#include "base/type.h"
 #include "opencv2/opencv.hpp"
+#include "keyframe_index.h"
 
 extern "C" {
 #include "libavcodec/avcodec.h"
@@ -39,6 +42,40 @@ struct AVCodec;
 struct AVPacket;
 
 
+    ///////////////////////////////////////////////////////////////////////////////
+    // Settings of FFMPEGVideoDecoder::Open() with options. The threading is
+    // applied by FFMPEGDecoder::OpenThreadedCodec().
+    struct FFMPEGDecoderOptions {
+        // Number of decoding threads, 0 uses one thread per core.
+        int thread_count;
+        // Combination of FF_THREAD_FRAME and FF_THREAD_SLICE. Types the codec
+        // does not support are ignored. Frame threading adds up to
+        // thread_count - 1 frames of decoding latency.
+        int thread_type;
+        // Maximum number of cores this stream may use, 0 for no limit. When
+        // several streams are decoded at the same time, give each one its
+        // share of the host, see SharedCpuBudget().
+        int cpu_budget;
+        // If true, the keyframe index is loaded from its sidecar or built on
+        // open, see FFMPEGVideoDecoder::LoadKeyframeIndex().
+        bool keyframe_index;
+
+        FFMPEGDecoderOptions()
+            : thread_count(0),
+              thread_type(FF_THREAD_FRAME | FF_THREAD_SLICE),
+              cpu_budget(0),
+              keyframe_index(true) {}
+
+        // Returns the number of cores each of num_streams concurrently decoded
+        // streams gets when the host is split evenly, at least 1.
+        static int SharedCpuBudget(int num_streams) {
+            int cores = static_cast<int>(std::thread::hardware_concurrency());
+            if (cores <= 0)
+                cores = 1;
+            return std::max(1, cores / std::max(1, num_streams));
+        }
+    };
+
     ///////////////////////////////////////////////////////////////////////////////
     // Generic standalone video and audio decoder, wrapping libavcodec
     // FilterDecoderFFMPEG will delegate them the actual decoding job
@@ -60,6 +97,13 @@ struct AVPacket;
         // Don't know if this really can fail, but users better check the return
         // value to be sure. Should not be called during decoding. Unit is seconds.
         bool Seek(double seek_time);
+
+        // Sets the codec options used by the next OpenThreadedCodec().
+        void set_options(const FFMPEGDecoderOptions &options) {
+            options_ = options;
+        }
+
+        const FFMPEGDecoderOptions &options() const { return options_; }
         
     protected:
         // Deallocate everything.  After this call, the decoder is ready
@@ -73,6 +117,18 @@ struct AVPacket;
         // Otherwise let ffmpeg determine the codec.
         bool MainOpen(const char* filename, int nth, int type,
                       const string &codec_name);
+
+        // Configures frame and slice threading of ctx from options_. Must be
+        // called after avcodec_ is set and before ctx is opened.
+        void ApplyThreadingOptions(AVCodecContext *ctx);
+
+        // Replaces the codec context opened by MainOpen() with a new one,
+        // configured with the threading of options_ and refcounted frames
+        // before it is opened: threading cannot be changed on an open codec,
+        // and libavcodec does not support reopening a context. Must be called
+        // before the first packet is decoded. Returns false if the codec
+        // cannot be opened.
+        bool OpenThreadedCodec();
         
         bool AllocPacket();  // Allocate AVPacket structure. Returns true if ok.
         void ClearPacket();  // Clear packet content (but not the AVPacket itself).
@@ -87,13 +143,139 @@ struct AVPacket;
         int              id_;   // Decoded stream index.
         int              frame_num_;
         bool             finished_;
+
+        FFMPEGDecoderOptions options_;
         
         // Scratch buffer for conversion.
         std::unique_ptr<uint8[]> buffer_;
         int                 buffer_size_;
         AVFrame            *tmp_frame_;
+
+    private:
+        static void FreeCodecContext(AVCodecContext *ctx) {
+            avcodec_free_context(&ctx);
+        }
+
+        // Context opened by OpenThreadedCodec() when MainReset() only closes
+        // avcodec_ctx_, see OpenThreadedCodec().
+        std::unique_ptr<AVCodecContext, void (*)(AVCodecContext *)> threaded_ctx_{
+            NULL, FreeCodecContext};
     };
     
+    inline void FFMPEGDecoder::ApplyThreadingOptions(AVCodecContext *ctx) {
+        int threads = options_.thread_count;
+        if (threads <= 0)
+            threads = static_cast<int>(std::thread::hardware_concurrency());
+        if (options_.cpu_budget > 0)
+            threads = std::min(threads, options_.cpu_budget);
+        threads = std::max(threads, 1);
+
+        int thread_type = options_.thread_type;
+        if (avcodec_ != NULL) {
+            if (!(avcodec_->capabilities & AV_CODEC_CAP_FRAME_THREADS))
+                thread_type &= ~FF_THREAD_FRAME;
+            if (!(avcodec_->capabilities & AV_CODEC_CAP_SLICE_THREADS))
+                thread_type &= ~FF_THREAD_SLICE;
+        }
+        ctx->thread_count = thread_type != 0 ? threads : 1;
+        ctx->thread_type = thread_type;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    inline bool FFMPEGDecoder::OpenThreadedCodec() {
+        if (avformat_ctx_ == NULL || avcodec_ctx_ == NULL || avcodec_ == NULL ||
+            id_ < 0)
+            return false;
+        if (avcodec_ctx_ == threaded_ctx_.get())
+            return true;
+        // The context of a previous file was closed by MainReset().
+        threaded_ctx_.reset();
+
+        AVStream *stream = avformat_ctx_->streams[id_];
+        AVCodecContext *ctx = avcodec_alloc_context3(avcodec_);
+        if (ctx == NULL ||
+            avcodec_parameters_to_context(ctx, stream->codecpar) < 0) {
+            printf("error: cannot configure codec %s\n", avcodec_->name);
+            avcodec_free_context(&ctx);
+            return false;
+        }
+        ctx->pkt_timebase = stream->time_base;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+        // Lets FFMPEGVideoDecoder::GetFrameRef() share the decoded buffers.
+        ctx->refcounted_frames = 1;
+#endif
+        ApplyThreadingOptions(ctx);
+        if (avcodec_open2(ctx, avcodec_, NULL) < 0) {
+            printf("error: cannot open codec with %d threads\n",
+                   ctx->thread_count);
+            avcodec_free_context(&ctx);
+            return false;
+        }
+
+        // MainReset() tears down avcodec_ctx_ the way the original context
+        // needs: a context of the stream is only closed, and the new one is
+        // then freed by threaded_ctx_; a context of its own is freed, so the
+        // original is freed here instead.
+        bool stream_context = false;
+#if FF_API_LAVF_AVCTX
+        stream_context = avcodec_ctx_ == stream->codec;
+#endif
+        if (stream_context) {
+            avcodec_close(avcodec_ctx_);
+            threaded_ctx_.reset(ctx);
+        } else {
+            avcodec_free_context(&avcodec_ctx_);
+        }
+        avcodec_ctx_ = ctx;
+        return true;
+    }
+#pragma GCC diagnostic pop
+
+    ///////////////////////////////////////////////////////////////////////////////
+
+    // A reference to a decoded picture, exposing its planes as cv::Mat views.
+    // The underlying buffer is reference counted by libavutil and stays valid
+    // while this object holds it, even after the decoder moved on to the next
+    // frame. Only planar 8-bit formats (YUV420P, YUVJ420P, NV12, GRAY8) can be
+    // wrapped.
+    class DecodedFrame {
+    public:
+        DecodedFrame() : frame_(NULL), num_planes_(0), timestamp_(0) {}
+        ~DecodedFrame() { Reset(); }
+
+        // Drops the reference to the picture buffer.
+        void Reset() {
+            if (frame_)
+                av_frame_free(&frame_);
+            for (int i = 0; i < 3; ++i)
+                planes_[i].release();
+            num_planes_ = 0;
+        }
+
+        bool empty() const { return frame_ == NULL; }
+
+        // Number of valid planes: 3 for YUV420P, 2 for NV12, 1 for GRAY8.
+        int num_planes() const { return num_planes_; }
+
+        // Returns the view on the ith plane. Modifying its pixels modifies the
+        // decoded picture shared with the decoder.
+        const cv::Mat& plane(int i) const { return planes_[i]; }
+
+        int64 timestamp() const { return timestamp_; }
+
+    private:
+        DecodedFrame(const DecodedFrame&) = delete;
+        DecodedFrame& operator=(const DecodedFrame&) = delete;
+
+        friend class FFMPEGVideoDecoder;
+
+        AVFrame *frame_;
+        cv::Mat  planes_[3];
+        int      num_planes_;
+        int64    timestamp_;
+    };
+
     ///////////////////////////////////////////////////////////////////////////////
     
     class FFMPEGVideoDecoder : public FFMPEGDecoder {
@@ -111,6 +293,24 @@ struct AVPacket;
         bool Open(const char* filename) {
             return Open(filename, 1, "");
         }
+
+        // Same as above, decoding with the given threading options. The
+        // stream gets a codec context opened with them once it is found, see
+        // OpenThreadedCodec(). A keyframe index that cannot be built only
+        // disables indexed seeks.
+        bool Open(const char* filename, int nth, const string &codec_name,
+                  const FFMPEGDecoderOptions &options) {
+            set_options(options);
+            if (!Open(filename, nth, codec_name))
+                return false;
+            if (!OpenThreadedCodec()) {
+                Reset();
+                return false;
+            }
+            if (options.keyframe_index && !LoadKeyframeIndex(filename, nth))
+                printf("warning: cannot index keyframes of %s\n", filename);
+            return true;
+        }
         
         // Decode the next frame.  Returns true if the frame is ready, false in
         // case of error or EOF.  Overwrites previous frame data.  Will block
@@ -119,6 +319,22 @@ struct AVPacket;
 
 		bool SeekTargetVideoFrame(int target_frame);
 		bool SeekToPreKeyFrame(int target_frame);
+
+        // Loads the keyframe index of the nth video stream of filename,
+        // building and caching it next to the video on first use. Open() with
+        // options calls it. filename must be the file passed to Open().
+        // Returns false if the index cannot be built.
+        bool LoadKeyframeIndex(const char* filename, int nth = 1) {
+            return keyframe_index_.LoadOrBuild(filename, nth);
+        }
+
+        const KeyframeIndex &keyframe_index() const { return keyframe_index_; }
+
+        // Makes target_frame the current frame, like SeekTargetVideoFrame(),
+        // but jumps directly to the preceding keyframe found in the index and
+        // decodes forward from there. Falls back to SeekTargetVideoFrame() when
+        // no index is loaded.
+        bool SeekIndexedFrame(int target_frame);
         
         // Returns the number of consumed frames.
         int ConsumedFrames() const { return frame_num_ - repeat_frame_; }
@@ -130,8 +346,14 @@ struct AVPacket;
         bool is_key_frame() const { return is_key_frame_; }
         
         // Should be called when a decoded frame is finished being processed
-        // to unblock DecodeLoop() when repeat_frame_ is 0.
-        void MarkFrameConsumed() { repeat_frame_--; }
+        // to unblock DecodeLoop() when repeat_frame_ is 0. The last call drops
+        // the decoder's reference to the picture, which the decode API wants
+        // before the next frame is decoded into yuv_frame_ with refcounted
+        // frames; references taken with GetFrameRef() stay valid.
+        void MarkFrameConsumed() {
+            if (--repeat_frame_ == 0 && yuv_frame_ != NULL)
+                av_frame_unref(yuv_frame_);
+        }
         
         // Deallocate everything. After this call the decoder is ready for
         // another file.
@@ -185,7 +407,23 @@ struct AVPacket;
         int64 timestamp() const { return timestamp_; }
         
         //convert avframe to opencv mat
+        // Allocates a new Mat on every call, prefer the overload below in
+        // per-frame loops.
         cv::Mat convert_avframe_to_mat();
+
+        // Converts the current frame to packed BGR into mat. The buffer of mat
+        // is reused when it already has the frame size and type CV_8UC3, so a
+        // caller passing the same Mat every frame does not allocate. The
+        // SwsContext is cached across calls. Returns false if no frame is
+        // available.
+        bool convert_avframe_to_mat(cv::Mat *mat);
+
+        // Wraps the current frame's planes in frame without copying any pixel:
+        // Open() with options decodes into refcounted frames, which frame then
+        // shares. After a plain Open() the decoder owns the picture and
+        // libavutil copies it once instead. Returns false if no frame is
+        // available or its pixel format cannot be wrapped.
+        bool GetFrameRef(DecodedFrame *frame) const;
         
     private:        
         AVFrame *yuv_frame_;
@@ -212,7 +450,103 @@ struct AVPacket;
         // AV_NOPTS_VALUE, no value has been recorded yet.
         int64    time_offset_dts_;
         int64    timestamp_;
+
+        KeyframeIndex keyframe_index_;
+
+        // Conversion context of convert_avframe_to_mat(cv::Mat*), recreated
+        // only when the source format or size changes.
+        std::unique_ptr<SwsContext, void (*)(SwsContext *)> sws_ctx_{
+            NULL, sws_freeContext};
     };
+
+    inline bool FFMPEGVideoDecoder::convert_avframe_to_mat(cv::Mat *mat) {
+        if (!have_frame() || yuv_frame_ == NULL || width_ <= 0 || height_ <= 0)
+            return false;
+
+        SwsContext *ctx = sws_getCachedContext(
+            sws_ctx_.release(), width_, height_,
+            static_cast<AVPixelFormat>(yuv_frame_->format),
+            width_, height_, AV_PIX_FMT_BGR24, SWS_BILINEAR, NULL, NULL, NULL);
+        sws_ctx_.reset(ctx);
+        if (ctx == NULL)
+            return false;
+
+        // No-op when mat already holds a frame of the same geometry.
+        mat->create(height_, width_, CV_8UC3);
+        uint8_t *dst_data[4] = {mat->data, NULL, NULL, NULL};
+        int dst_linesize[4] = {static_cast<int>(mat->step[0]), 0, 0, 0};
+        sws_scale(ctx, yuv_frame_->data, yuv_frame_->linesize, 0, height_,
+                  dst_data, dst_linesize);
+        return true;
+    }
+
+    inline bool FFMPEGVideoDecoder::SeekIndexedFrame(int target_frame) {
+        const KeyframeEntry *key = keyframe_index_.Lookup(target_frame);
+        if (key == NULL)
+            return SeekTargetVideoFrame(target_frame);
+
+        int64 ts = key->pts != AV_NOPTS_VALUE ? key->pts : key->dts;
+        if (av_seek_frame(avformat_ctx_, id_, ts, AVSEEK_FLAG_BACKWARD) < 0 &&
+            (key->pos < 0 ||
+             av_seek_frame(avformat_ctx_, id_, key->pos, AVSEEK_FLAG_BYTE) < 0))
+            return false;
+        avcodec_flush_buffers(avcodec_ctx_);
+        ClearPacket();
+        finished_ = false;
+        repeat_frame_ = 0;
+        frame_num_ = key->frame;
+
+        // At most one GOP is decoded to reach the target.
+        while (frame_num_ <= target_frame) {
+            if (have_frame())
+                MarkFrameConsumed();
+            if (!DecodeLoop())
+                return false;
+        }
+        return have_frame();
+    }
+
+    inline bool FFMPEGVideoDecoder::GetFrameRef(DecodedFrame *frame) const {
+        frame->Reset();
+        if (!have_frame() || yuv_frame_ == NULL)
+            return false;
+
+        int chroma_rows = 0, chroma_cols = 0, chroma_type = 0;
+        switch (yuv_frame_->format) {
+            case AV_PIX_FMT_YUV420P:
+            case AV_PIX_FMT_YUVJ420P:
+                frame->num_planes_ = 3;
+                chroma_rows = (height_ + 1) / 2;
+                chroma_cols = (width_ + 1) / 2;
+                chroma_type = CV_8UC1;
+                break;
+            case AV_PIX_FMT_NV12:
+                frame->num_planes_ = 2;
+                chroma_rows = (height_ + 1) / 2;
+                chroma_cols = (width_ + 1) / 2;
+                chroma_type = CV_8UC2;
+                break;
+            case AV_PIX_FMT_GRAY8:
+                frame->num_planes_ = 1;
+                break;
+            default:
+                return false;
+        }
+
+        frame->frame_ = av_frame_alloc();
+        if (frame->frame_ == NULL || av_frame_ref(frame->frame_, yuv_frame_) < 0) {
+            frame->Reset();
+            return false;
+        }
+        AVFrame *ref = frame->frame_;
+        frame->planes_[0] = cv::Mat(height_, width_, CV_8UC1, ref->data[0],
+                                    ref->linesize[0]);
+        for (int i = 1; i < frame->num_planes_; ++i)
+            frame->planes_[i] = cv::Mat(chroma_rows, chroma_cols, chroma_type,
+                                        ref->data[i], ref->linesize[i]);
+        frame->timestamp_ = timestamp_;
+        return true;
+    }
     
     class FFMPEGAudioDecoder : public FFMPEGDecoder {
     public:
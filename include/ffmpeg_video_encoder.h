@@ -0,0 +1,541 @@
+// Streaming video encoder using the ffmpeg library.
+//
+// Frames are pushed from memory, either as BGR images or as YUV420P planes,
+// into a bounded queue of preallocated slots. Conversion and encoding run on
+// the encoder's own thread, so the producer only pays for one copy into the
+// queue and only blocks when the encoder falls more than the queue size
+// behind. Packets are muxed directly into the output container (e.g. MP4)
+// with timestamps in the stream time base, no intermediate raw stream is
+// written. The audio track of a source recording can be copied alongside
+// without being decoded.
+
+#ifndef FFMPEG_VIDEO_ENCODER_H_
+#define FFMPEG_VIDEO_ENCODER_H_
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libswscale/swscale.h"
+}
+
+// Codec settings used by FFMPEGVideoEncoder::Open().
+struct FFMPEGVideoEncoderOptions {
+    // Number of encoding threads, 0 uses one thread per core.
+    int thread_count;
+    // Speed/compression trade-off of libx264 ("ultrafast" ... "veryslow").
+    // Ignored by codecs without presets.
+    std::string preset;
+    // Constant quality factor of libx264, lower is better. Negative selects
+    // average bit rate mode with bit_rate instead.
+    int crf;
+    // Average bit rate in bits per second when crf is negative.
+    int64_t bit_rate;
+    // Distance between keyframes, in frames.
+    int gop_size;
+    // Maximum number of consecutive B-frames, 0 disables them. Streams
+    // remuxed by convert2MP4(), whose timestamps are rebuilt in decode
+    // order, must not have any.
+    int max_b_frames;
+    double frame_rate;
+    // Frames buffered ahead of the encoder thread.
+    int queue_size;
+    // If not empty, the first audio stream of this file is copied into the
+    // output without decoding, e.g. the recording of one of the cameras.
+    std::string audio_source;
+    // Position in audio_source, in seconds, that matches the first frame.
+    double audio_offset;
+
+    FFMPEGVideoEncoderOptions()
+        : thread_count(0),
+          preset("medium"),
+          crf(23),
+          bit_rate(4000000),
+          gop_size(25),
+          max_b_frames(0),
+          frame_rate(30.0),
+          queue_size(4),
+          audio_offset(0.0) {}
+};
+
+class FFMPEGVideoEncoder {
+public:
+    FFMPEGVideoEncoder();
+
+    // Flushes the encoder if it is still open.
+    ~FFMPEGVideoEncoder();
+
+    // Creates output_file, whose container is guessed from its name, for
+    // frames of frame_size. Returns false in case of error.
+    bool Open(const char *output_file, cv::Size frame_size,
+              const FFMPEGVideoEncoderOptions &options = FFMPEGVideoEncoderOptions());
+
+    // Queues a BGR frame, of type CV_8UC3. It is resized if it does not have
+    // the size given to Open(). Blocks while the queue is full. Returns false
+    // if the frame is empty or of another type, or if the encoder is not open
+    // or failed.
+    bool Push(const cv::Mat &bgr);
+
+    // Queues a YUV420P frame given as its three CV_8UC1 planes, chroma planes
+    // having half the resolution of the luma plane. Returns false on planes of
+    // another type or size, as Push() does.
+    bool PushYUV(const cv::Mat &y, const cv::Mat &u, const cv::Mat &v);
+
+    // Encodes the queued frames, drains the frames delayed by the codec,
+    // writes the trailer and closes the file. Returns false if any frame
+    // failed to encode.
+    bool Flush();
+
+    bool is_open() const { return format_ctx_ != NULL; }
+
+    // Number of frames handed to the codec so far. May be called while frames
+    // are being encoded.
+    int frames_encoded() const { return frames_encoded_.load(); }
+
+private:
+    FFMPEGVideoEncoder(const FFMPEGVideoEncoder &) = delete;
+    FFMPEGVideoEncoder &operator=(const FFMPEGVideoEncoder &) = delete;
+
+    struct Slot {
+        cv::Mat bgr;
+        cv::Mat planes[3];
+        bool    is_yuv;
+    };
+
+    // Waits for a free slot. Returns NULL if the encoder stopped.
+    Slot *AcquireSlot();
+    void PublishSlot();
+
+    void EncodeLoop();
+
+    // Encodes frame, or drains the codec if frame is NULL.
+    bool EncodeFrame(AVFrame *frame);
+
+    // Opens the audio stream of source and adds its copy to the output. Must
+    // be called before the header is written.
+    bool OpenAudioPassthrough(const std::string &source, double offset);
+
+    // Copies the source audio packets up to time (seconds of output), so
+    // that audio and video stay interleaved.
+    bool CopyAudioUntil(double time);
+
+    // Releases every ffmpeg object.
+    void Close();
+
+    AVFormatContext *format_ctx_;
+    AVStream        *stream_;
+    AVCodecContext  *codec_ctx_;
+    SwsContext      *sws_ctx_;
+    AVFrame         *yuv_frame_;
+    cv::Size         frame_size_;
+    // Written by the encoder thread, read by producers.
+    std::atomic<int> frames_encoded_;
+
+    // Audio passthrough, audio_in_ctx_ is NULL when disabled.
+    AVFormatContext *audio_in_ctx_;
+    int              audio_in_index_;
+    AVStream        *audio_stream_;
+    // Source timestamp of the first copied sample.
+    int64_t          audio_start_pts_;
+    // Packet read ahead of the video, pending until its time comes.
+    AVPacket         audio_packet_;
+    bool             audio_pending_;
+
+    // Ring of slots: [head_, head_ + count_) hold frames waiting for the
+    // encoder thread.
+    std::vector<Slot>       slots_;
+    int                     head_;
+    int                     count_;
+    bool                    stop_;
+    bool                    failed_;
+    std::mutex              mutex_;
+    std::condition_variable slot_free_;
+    std::condition_variable slot_filled_;
+    std::thread             thread_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline FFMPEGVideoEncoder::FFMPEGVideoEncoder()
+    : format_ctx_(NULL), stream_(NULL), codec_ctx_(NULL), sws_ctx_(NULL),
+      yuv_frame_(NULL), frames_encoded_(0), audio_in_ctx_(NULL),
+      audio_in_index_(-1), audio_stream_(NULL), audio_start_pts_(0),
+      audio_pending_(false), head_(0), count_(0), stop_(false),
+      failed_(false) {}
+
+inline FFMPEGVideoEncoder::~FFMPEGVideoEncoder() {
+    if (is_open())
+        Flush();
+}
+
+inline bool FFMPEGVideoEncoder::Open(const char *output_file, cv::Size frame_size,
+                                     const FFMPEGVideoEncoderOptions &options) {
+    if (is_open())
+        Flush();
+
+    av_register_all();
+    frame_size_ = frame_size;
+    frames_encoded_ = 0;
+    avformat_alloc_output_context2(&format_ctx_, NULL, NULL, output_file);
+    if (format_ctx_ == NULL) {
+        printf("error: cannot create output context for %s\n", output_file);
+        return false;
+    }
+    if (avio_open(&format_ctx_->pb, output_file, AVIO_FLAG_WRITE) < 0) {
+        printf("error: cannot OPEN Format Context...\n");
+        Close();
+        return false;
+    }
+    stream_ = avformat_new_stream(format_ctx_, 0);
+    if (stream_ == NULL) {
+        printf("error : cannot Open Stream...\n");
+        Close();
+        return false;
+    }
+
+    codec_ctx_ = stream_->codec;
+    codec_ctx_->codec_id = format_ctx_->oformat->video_codec;
+    codec_ctx_->codec_type = AVMEDIA_TYPE_VIDEO;
+    codec_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_ctx_->width = frame_size.width;
+    codec_ctx_->height = frame_size.height;
+    codec_ctx_->time_base = av_inv_q(av_d2q(options.frame_rate, 100000));
+    codec_ctx_->gop_size = options.gop_size;
+    codec_ctx_->max_b_frames = options.max_b_frames;
+    codec_ctx_->thread_count = options.thread_count > 0 ?
+        options.thread_count : std::max(1, (int)std::thread::hardware_concurrency());
+    codec_ctx_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (options.crf < 0)
+        codec_ctx_->bit_rate = options.bit_rate;
+    codec_ctx_->sample_aspect_ratio.num = 1;
+    codec_ctx_->sample_aspect_ratio.den = 1;
+    // MP4 and similar containers store SPS/PPS in the header, not in-band.
+    if (format_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
+        codec_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // Private options of the codec, left in the dictionary if unsupported.
+    AVDictionary *codec_options = NULL;
+    if (!options.preset.empty())
+        av_dict_set(&codec_options, "preset", options.preset.c_str(), 0);
+    if (options.crf >= 0)
+        av_dict_set_int(&codec_options, "crf", options.crf, 0);
+
+    AVCodec *codec = avcodec_find_encoder(codec_ctx_->codec_id);
+    int ret = codec == NULL ? -1 : avcodec_open2(codec_ctx_, codec, &codec_options);
+    av_dict_free(&codec_options);
+    if (ret < 0) {
+        printf("error : cannot OPEN Encoder\n");
+        Close();
+        return false;
+    }
+    // The muxer may still change the stream time base in
+    // avformat_write_header(), packets are rescaled to whatever it picks.
+    stream_->time_base = codec_ctx_->time_base;
+    stream_->avg_frame_rate = av_inv_q(codec_ctx_->time_base);
+    if (avcodec_parameters_from_context(stream_->codecpar, codec_ctx_) < 0) {
+        printf("error : cannot set stream parameters\n");
+        Close();
+        return false;
+    }
+
+    yuv_frame_ = av_frame_alloc();
+    yuv_frame_->format = AV_PIX_FMT_YUV420P;
+    yuv_frame_->width = frame_size.width;
+    yuv_frame_->height = frame_size.height;
+    sws_ctx_ = sws_getContext(frame_size.width, frame_size.height, AV_PIX_FMT_BGR24,
+                              frame_size.width, frame_size.height, AV_PIX_FMT_YUV420P,
+                              SWS_POINT, NULL, NULL, NULL);
+    if (!options.audio_source.empty() &&
+        !OpenAudioPassthrough(options.audio_source, options.audio_offset)) {
+        Close();
+        return false;
+    }
+    if (av_frame_get_buffer(yuv_frame_, 32) < 0 || sws_ctx_ == NULL ||
+        avformat_write_header(format_ctx_, NULL) < 0) {
+        printf("error : cannot start encoding\n");
+        Close();
+        return false;
+    }
+
+    // Every slot is allocated here, pushing frames does not allocate.
+    slots_.resize(std::max(options.queue_size, 1));
+    const cv::Size chroma_size((frame_size.width + 1) / 2, (frame_size.height + 1) / 2);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        slots_[i].bgr.create(frame_size, CV_8UC3);
+        slots_[i].planes[0].create(frame_size, CV_8UC1);
+        slots_[i].planes[1].create(chroma_size, CV_8UC1);
+        slots_[i].planes[2].create(chroma_size, CV_8UC1);
+        slots_[i].is_yuv = false;
+    }
+    head_ = 0;
+    count_ = 0;
+    stop_ = false;
+    failed_ = false;
+    thread_ = std::thread(&FFMPEGVideoEncoder::EncodeLoop, this);
+    return true;
+}
+
+inline FFMPEGVideoEncoder::Slot *FFMPEGVideoEncoder::AcquireSlot() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    slot_free_.wait(lock, [this] {
+        return stop_ || failed_ || count_ < static_cast<int>(slots_.size());
+    });
+    if (stop_ || failed_)
+        return NULL;
+    // Only the producer adds slots, so this one stays free until published.
+    return &slots_[(head_ + count_) % slots_.size()];
+}
+
+inline void FFMPEGVideoEncoder::PublishSlot() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++count_;
+    }
+    slot_filled_.notify_one();
+}
+
+inline bool FFMPEGVideoEncoder::Push(const cv::Mat &bgr) {
+    // Any other type would be read as BGR24 by sws_scale() and reallocate
+    // the slot.
+    if (bgr.type() != CV_8UC3 || bgr.empty()) {
+        printf("error : cannot encode a frame of type %d\n", bgr.type());
+        return false;
+    }
+    if (!is_open())
+        return false;
+    Slot *slot = AcquireSlot();
+    if (slot == NULL)
+        return false;
+    if (bgr.size() == frame_size_)
+        bgr.copyTo(slot->bgr);
+    else
+        cv::resize(bgr, slot->bgr, frame_size_);
+    slot->is_yuv = false;
+    PublishSlot();
+    return true;
+}
+
+inline bool FFMPEGVideoEncoder::PushYUV(const cv::Mat &y, const cv::Mat &u,
+                                        const cv::Mat &v) {
+    if (y.type() != CV_8UC1 || u.type() != CV_8UC1 || v.type() != CV_8UC1) {
+        printf("error : cannot encode YUV planes of types %d %d %d\n",
+               y.type(), u.type(), v.type());
+        return false;
+    }
+    if (!is_open() || y.size() != frame_size_ ||
+        u.size() != slots_[0].planes[1].size() || v.size() != u.size())
+        return false;
+    Slot *slot = AcquireSlot();
+    if (slot == NULL)
+        return false;
+    y.copyTo(slot->planes[0]);
+    u.copyTo(slot->planes[1]);
+    v.copyTo(slot->planes[2]);
+    slot->is_yuv = true;
+    PublishSlot();
+    return true;
+}
+
+inline void FFMPEGVideoEncoder::EncodeLoop() {
+    while (true) {
+        Slot *slot = NULL;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            slot_filled_.wait(lock, [this] { return stop_ || count_ > 0; });
+            if (count_ == 0)
+                return;  // Stopped and drained.
+            slot = &slots_[head_];
+        }
+
+        // failed_ is only written by this thread, no lock needed to read it.
+        bool ok = !failed_ && av_frame_make_writable(yuv_frame_) >= 0;
+        if (ok && slot->is_yuv) {
+            for (int p = 0; p < 3; ++p) {
+                const cv::Mat &plane = slot->planes[p];
+                cv::Mat dst(plane.size(), CV_8UC1, yuv_frame_->data[p],
+                            yuv_frame_->linesize[p]);
+                plane.copyTo(dst);
+            }
+        } else if (ok) {
+            const uint8_t *src_data[4] = {slot->bgr.data, NULL, NULL, NULL};
+            int src_linesize[4] = {static_cast<int>(slot->bgr.step[0]), 0, 0, 0};
+            sws_scale(sws_ctx_, src_data, src_linesize, 0, frame_size_.height,
+                      yuv_frame_->data, yuv_frame_->linesize);
+        }
+        if (ok) {
+            yuv_frame_->pts = frames_encoded_++;
+            ok = EncodeFrame(yuv_frame_);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            head_ = (head_ + 1) % slots_.size();
+            --count_;
+            if (!ok)
+                failed_ = true;
+        }
+        slot_free_.notify_one();
+    }
+}
+
+inline bool FFMPEGVideoEncoder::EncodeFrame(AVFrame *frame) {
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    // Without a frame, loop until the codec has no delayed packet left.
+    do {
+        int got_packet = 0;
+        if (avcodec_encode_video2(codec_ctx_, &packet, frame, &got_packet) < 0) {
+            printf("error : failing in encoder...\n");
+            return false;
+        }
+        if (!got_packet)
+            return true;
+        packet.stream_index = stream_->index;
+        av_packet_rescale_ts(&packet, codec_ctx_->time_base, stream_->time_base);
+        if (audio_in_ctx_ != NULL &&
+            !CopyAudioUntil(packet.dts * av_q2d(stream_->time_base))) {
+            av_packet_unref(&packet);
+            return false;
+        }
+        int ret = av_interleaved_write_frame(format_ctx_, &packet);
+        av_packet_unref(&packet);
+        if (ret < 0) {
+            printf("error : cannot write frame\n");
+            return false;
+        }
+    } while (frame == NULL);
+    return true;
+}
+
+inline bool FFMPEGVideoEncoder::Flush() {
+    if (!is_open())
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    slot_filled_.notify_one();
+    slot_free_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+
+    bool ok = !failed_;
+    if (codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY)
+        ok = EncodeFrame(NULL) && ok;
+    // Audio runs until the end of the last frame.
+    if (audio_in_ctx_ != NULL)
+        ok = CopyAudioUntil(frames_encoded_ * av_q2d(codec_ctx_->time_base)) && ok;
+    av_write_trailer(format_ctx_);
+    Close();
+    return ok;
+}
+
+inline bool FFMPEGVideoEncoder::OpenAudioPassthrough(const std::string &source,
+                                                     double offset) {
+    if (avformat_open_input(&audio_in_ctx_, source.c_str(), NULL, NULL) < 0 ||
+        avformat_find_stream_info(audio_in_ctx_, NULL) < 0) {
+        printf("error: cannot open audio source %s\n", source.c_str());
+        return false;
+    }
+    audio_in_index_ = av_find_best_stream(audio_in_ctx_, AVMEDIA_TYPE_AUDIO,
+                                          -1, -1, NULL, 0);
+    if (audio_in_index_ < 0) {
+        printf("error: no audio stream in %s\n", source.c_str());
+        return false;
+    }
+    AVStream *in_stream = audio_in_ctx_->streams[audio_in_index_];
+
+    audio_stream_ = avformat_new_stream(format_ctx_, NULL);
+    if (audio_stream_ == NULL ||
+        avcodec_parameters_copy(audio_stream_->codecpar, in_stream->codecpar) < 0) {
+        printf("error: cannot create audio stream\n");
+        return false;
+    }
+    // The source tag may not be valid in the output container.
+    audio_stream_->codecpar->codec_tag = 0;
+    audio_stream_->time_base = in_stream->time_base;
+
+    int64_t start = in_stream->start_time != AV_NOPTS_VALUE ? in_stream->start_time : 0;
+    audio_start_pts_ = start + av_rescale_q(static_cast<int64_t>(offset * AV_TIME_BASE),
+                                            AV_TIME_BASE_Q, in_stream->time_base);
+    if (offset > 0)
+        av_seek_frame(audio_in_ctx_, audio_in_index_, audio_start_pts_,
+                      AVSEEK_FLAG_BACKWARD);
+    av_init_packet(&audio_packet_);
+    audio_packet_.data = NULL;
+    audio_packet_.size = 0;
+    audio_pending_ = false;
+    return true;
+}
+
+inline bool FFMPEGVideoEncoder::CopyAudioUntil(double time) {
+    AVStream *in_stream = audio_in_ctx_->streams[audio_in_index_];
+    while (true) {
+        if (!audio_pending_) {
+            if (av_read_frame(audio_in_ctx_, &audio_packet_) < 0)
+                return true;  // End of the source audio.
+            if (audio_packet_.stream_index != audio_in_index_ ||
+                audio_packet_.pts == AV_NOPTS_VALUE ||
+                audio_packet_.pts < audio_start_pts_) {
+                av_packet_unref(&audio_packet_);
+                continue;
+            }
+            // Shift the source so that audio_start_pts_ lands on time 0.
+            audio_packet_.pts -= audio_start_pts_;
+            if (audio_packet_.dts != AV_NOPTS_VALUE)
+                audio_packet_.dts -= audio_start_pts_;
+            audio_pending_ = true;
+        }
+        if (audio_packet_.pts * av_q2d(in_stream->time_base) > time)
+            return true;
+
+        av_packet_rescale_ts(&audio_packet_, in_stream->time_base,
+                             audio_stream_->time_base);
+        audio_packet_.stream_index = audio_stream_->index;
+        audio_packet_.pos = -1;
+        audio_pending_ = false;
+        // Takes ownership of the packet data and resets the packet.
+        if (av_interleaved_write_frame(format_ctx_, &audio_packet_) < 0) {
+            printf("error : cannot write audio packet\n");
+            return false;
+        }
+    }
+}
+
+inline void FFMPEGVideoEncoder::Close() {
+    if (sws_ctx_ != NULL)
+        sws_freeContext(sws_ctx_);
+    sws_ctx_ = NULL;
+    av_frame_free(&yuv_frame_);
+    if (codec_ctx_ != NULL && avcodec_is_open(codec_ctx_))
+        avcodec_close(codec_ctx_);
+    codec_ctx_ = NULL;
+    stream_ = NULL;
+    if (audio_pending_)
+        av_packet_unref(&audio_packet_);
+    audio_pending_ = false;
+    if (audio_in_ctx_ != NULL)
+        avformat_close_input(&audio_in_ctx_);
+    audio_stream_ = NULL;
+    if (format_ctx_ != NULL) {
+        if (format_ctx_->pb != NULL)
+            avio_closep(&format_ctx_->pb);
+        avformat_free_context(format_ctx_);
+    }
+    format_ctx_ = NULL;
+}
+
+#endif  // FFMPEG_VIDEO_ENCODER_H_
@@ -0,0 +1,296 @@
+// Lock-free handoff of frames between two pipeline threads.
+//
+// FrameRing connects exactly one producer thread (e.g. capture) to exactly one
+// consumer thread (e.g. composition). Frames live in slots allocated once, up
+// front; the threads only exchange slot numbers through two atomic index
+// rings, so passing a frame neither locks nor allocates. The producer fills
+// the slot returned by AcquireWrite() in place and hands it over with
+// PublishWrite(); the consumer reads the slot returned by AcquireRead() and
+// gives it back with ReleaseRead(). Each side holds at most one slot at a
+// time.
+//
+// When capacity frames are waiting, a producer in FRAME_RING_BLOCK mode waits
+// for the consumer, while in FRAME_RING_OVERWRITE_OLDEST mode it takes back
+// the oldest waiting frame and reuses its slot, which keeps the latency of a
+// slow consumer bounded to capacity frames.
+//
+// A side that has to wait spins for a few rounds, then sleeps on a condition
+// variable. The other side only takes the lock to signal it when a thread is
+// actually asleep, so an idle consumer costs no CPU and the handoff stays
+// lock-free while both sides keep up.
+
+#ifndef FRAME_RING_H_
+#define FRAME_RING_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "opencv2/opencv.hpp"
+
+enum FrameRingMode {
+    FRAME_RING_BLOCK,
+    FRAME_RING_OVERWRITE_OLDEST,
+};
+
+template <typename Frame = cv::Mat>
+class FrameRing {
+public:
+    // capacity is the number of published frames that may wait for the
+    // consumer, at least 1. capacity + 2 slots are allocated so that both
+    // sides can hold one slot while the ring is full.
+    FrameRing(int capacity, FrameRingMode mode);
+
+    // Calls init on every slot, e.g. to allocate the images to their final
+    // size. Must be called before the threads start.
+    template <typename Init>
+    void InitSlots(Init init) {
+        for (int i = 0; i < num_slots_; ++i)
+            init(slots_[i]);
+    }
+
+    // Producer side. Returns the slot to fill, or NULL if the ring is full
+    // (FRAME_RING_BLOCK only) or closed. The slot contents are those of an
+    // earlier frame; write into them rather than reassigning to keep the
+    // buffers.
+    Frame *TryAcquireWrite();
+    // Same as TryAcquireWrite() but waits for room. Returns NULL once closed.
+    Frame *AcquireWrite();
+    // Makes the slot returned by the last AcquireWrite() visible to the
+    // consumer.
+    void PublishWrite();
+
+    // Consumer side. Returns the oldest published frame, or NULL if there is
+    // none. The previous frame must have been released.
+    Frame *TryAcquireRead();
+    // Same as TryAcquireRead() but waits for a frame. Returns NULL once the
+    // ring is closed and drained.
+    Frame *AcquireRead();
+    // Returns the slot of the last AcquireRead() to the producer.
+    void ReleaseRead();
+
+    // Wakes both sides up for good. Frames already published can still be
+    // read.
+    void Close() {
+        closed_.store(true, std::memory_order_release);
+        Notify();
+    }
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+    // Number of published frames waiting for the consumer.
+    int size() const {
+        return static_cast<int>(filled_tail_.load(std::memory_order_acquire) -
+                                filled_head_.load(std::memory_order_acquire));
+    }
+    int capacity() const { return capacity_; }
+
+    // Number of frames overwritten before the consumer read them.
+    int64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    // Pops the oldest published slot for the consumer. The producer may
+    // take the same frame back when it overwrites, hence the
+    // compare-and-swap on the head.
+    int PopFilled();
+
+    // Returns the frame of try_acquire(), waiting for one until the ring is
+    // closed: spins first, then sleeps until Notify().
+    template <typename TryAcquire>
+    Frame *Wait(TryAcquire try_acquire);
+
+    // Wakes a side sleeping in Wait(), after the state it waits on changed.
+    void Notify();
+
+    // Rounds of yield() before Wait() goes to sleep.
+    static const int kSpins = 16;
+
+    const int capacity_;
+    const int num_slots_;
+    const FrameRingMode mode_;
+    std::unique_ptr<Frame[]> slots_;
+
+    // Published slots, oldest at filled_head_. Counters only grow, so a stale
+    // head can never be mistaken for a current one.
+    std::unique_ptr<std::atomic<int>[]> filled_;
+    std::atomic<uint64_t> filled_head_;
+    std::atomic<uint64_t> filled_tail_;
+
+    // Slots released by the consumer, pushed by the consumer and popped by
+    // the producer.
+    std::unique_ptr<std::atomic<int>[]> free_;
+    std::atomic<uint64_t> free_head_;
+    std::atomic<uint64_t> free_tail_;
+
+    // Slots held by each side, -1 if none. Only touched by their own thread.
+    int write_slot_;
+    int read_slot_;
+
+    std::atomic<bool> closed_;
+    std::atomic<int64_t> dropped_;
+
+    // Threads asleep in Wait(), at most one per side.
+    std::atomic<int> sleepers_;
+    std::mutex wait_mutex_;
+    std::condition_variable wake_;
+};
+
+// -------------------------- implementation ------------------------------
+
+template <typename Frame>
+FrameRing<Frame>::FrameRing(int capacity, FrameRingMode mode)
+    : capacity_(capacity < 1 ? 1 : capacity),
+      num_slots_(capacity_ + 2),
+      mode_(mode),
+      slots_(new Frame[num_slots_]),
+      filled_(new std::atomic<int>[num_slots_]),
+      filled_head_(0),
+      filled_tail_(0),
+      free_(new std::atomic<int>[num_slots_]),
+      free_head_(0),
+      free_tail_(num_slots_),
+      write_slot_(-1),
+      read_slot_(-1),
+      closed_(false),
+      dropped_(0),
+      sleepers_(0) {
+    for (int i = 0; i < num_slots_; ++i) {
+        filled_[i].store(-1, std::memory_order_relaxed);
+        free_[i].store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename Frame>
+int FrameRing<Frame>::PopFilled() {
+    uint64_t head = filled_head_.load(std::memory_order_acquire);
+    while (head != filled_tail_.load(std::memory_order_acquire)) {
+        int slot = filled_[head % num_slots_].load(std::memory_order_relaxed);
+        // On failure head is reloaded: the other side took that frame.
+        if (filled_head_.compare_exchange_weak(head, head + 1,
+                                               std::memory_order_acq_rel))
+            return slot;
+    }
+    return -1;
+}
+
+template <typename Frame>
+template <typename TryAcquire>
+Frame *FrameRing<Frame>::Wait(TryAcquire try_acquire) {
+    for (int spin = 0;; ++spin) {
+        // Check closed before trying, so that frames published just before
+        // Close() are not lost.
+        bool was_closed = closed();
+        Frame *frame = try_acquire();
+        if (frame != NULL || was_closed)
+            return frame;
+        if (spin < kSpins) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        sleepers_.fetch_add(1, std::memory_order_relaxed);
+        // Pairs with the fence of Notify(): either it sees the sleeper and
+        // signals under the lock, or the check below sees its change.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        was_closed = closed();
+        frame = try_acquire();
+        if (frame == NULL && !was_closed)
+            wake_.wait(lock);
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        if (frame != NULL || was_closed)
+            return frame;
+    }
+}
+
+template <typename Frame>
+void FrameRing<Frame>::Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) == 0)
+        return;
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    wake_.notify_all();
+}
+
+template <typename Frame>
+Frame *FrameRing<Frame>::TryAcquireWrite() {
+    if (closed())
+        return NULL;
+    if (write_slot_ >= 0)
+        return &slots_[write_slot_];
+
+    uint64_t head = filled_head_.load(std::memory_order_acquire);
+    if (filled_tail_.load(std::memory_order_relaxed) - head >= (uint64_t)capacity_) {
+        if (mode_ == FRAME_RING_BLOCK)
+            return NULL;
+        // Take the oldest frame back, unless the consumer gets it first, in
+        // which case there is room again.
+        int slot = filled_[head % num_slots_].load(std::memory_order_relaxed);
+        if (filled_head_.compare_exchange_strong(head, head + 1,
+                                                 std::memory_order_acq_rel)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            write_slot_ = slot;
+            return &slots_[write_slot_];
+        }
+    }
+
+    // With fewer than capacity frames published and at most one slot held by
+    // the consumer, at least one slot is free.
+    head = free_head_.load(std::memory_order_relaxed);
+    if (head == free_tail_.load(std::memory_order_acquire))
+        return NULL;
+    write_slot_ = free_[head % num_slots_].load(std::memory_order_relaxed);
+    free_head_.store(head + 1, std::memory_order_release);
+    return &slots_[write_slot_];
+}
+
+template <typename Frame>
+Frame *FrameRing<Frame>::AcquireWrite() {
+    return Wait([this] { return TryAcquireWrite(); });
+}
+
+template <typename Frame>
+void FrameRing<Frame>::PublishWrite() {
+    if (write_slot_ < 0)
+        return;
+    uint64_t tail = filled_tail_.load(std::memory_order_relaxed);
+    filled_[tail % num_slots_].store(write_slot_, std::memory_order_relaxed);
+    // Release makes the slot contents visible along with the new tail.
+    filled_tail_.store(tail + 1, std::memory_order_release);
+    write_slot_ = -1;
+    Notify();
+}
+
+template <typename Frame>
+Frame *FrameRing<Frame>::TryAcquireRead() {
+    if (read_slot_ >= 0)
+        return &slots_[read_slot_];
+    read_slot_ = PopFilled();
+    if (read_slot_ < 0)
+        return NULL;
+    // A blocked producer may have room again.
+    if (mode_ == FRAME_RING_BLOCK)
+        Notify();
+    return &slots_[read_slot_];
+}
+
+template <typename Frame>
+Frame *FrameRing<Frame>::AcquireRead() {
+    return Wait([this] { return TryAcquireRead(); });
+}
+
+template <typename Frame>
+void FrameRing<Frame>::ReleaseRead() {
+    if (read_slot_ < 0)
+        return;
+    uint64_t tail = free_tail_.load(std::memory_order_relaxed);
+    free_[tail % num_slots_].store(read_slot_, std::memory_order_relaxed);
+    free_tail_.store(tail + 1, std::memory_order_release);
+    read_slot_ = -1;
+    if (mode_ == FRAME_RING_BLOCK)
+        Notify();
+}
+
+#endif  // FRAME_RING_H_
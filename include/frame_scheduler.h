@@ -0,0 +1,254 @@
+// Latency-bounded scheduling of live composition.
+//
+// FrameScheduler sits between the capture thread and Composition::run. The
+// capture thread submits camera frame sets as they arrive; a compose thread
+// takes the freshest one, composes it and hands the result to a sink. When
+// composition falls behind, sets are dropped instead of queued so the latency
+// stays within a budget:
+//   - at most queue_capacity sets wait, a newer set replaces the oldest;
+//   - a waiting set already older than the budget is skipped if a newer one
+//     is available;
+//   - after degrade_after_misses consecutive deadline misses the quality is
+//     lowered one step (skip Poisson blending, then reuse the last gains), and
+//     raised again after recover_after_hits frames on time.
+
+#ifndef FRAME_SCHEDULER_H_
+#define FRAME_SCHEDULER_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+#include "frame_ring.h"
+
+// Quality levels of the compose callback, from best to fastest.
+enum CompositionQuality
+{
+    QUALITY_FULL = 0,
+    QUALITY_SKIP_POISSON,  // Tone adjusted by gains only.
+    QUALITY_REUSE_GAINS,   // Gains of an earlier frame, no Poisson blending.
+    QUALITY_LOWEST = QUALITY_REUSE_GAINS,
+};
+
+struct FrameSchedulerOptions
+{
+    // Time from capture to the composed frame reaching the sink.
+    int latency_budget_ms;
+    // Number of frame sets that may wait for composition.
+    int queue_capacity;
+    // Whether the quality may be lowered to meet the budget.
+    bool allow_degrade;
+    int degrade_after_misses;
+    int recover_after_hits;
+
+    FrameSchedulerOptions()
+    {
+        latency_budget_ms = 100;
+        queue_capacity = 1;
+        allow_degrade = true;
+        degrade_after_misses = 3;
+        recover_after_hits = 30;
+    }
+};
+
+struct FrameSchedulerStats
+{
+    int64_t submitted;
+    int64_t composed;
+    // Sets replaced by a newer one before composition started.
+    int64_t overwritten;
+    // Sets skipped because they were already older than the budget.
+    int64_t stale;
+    // Composed frames that reached the sink after the budget.
+    int64_t deadline_misses;
+    // Latencies of the last and the slowest composed frame, in microseconds.
+    int64_t last_latency_us;
+    int64_t max_latency_us;
+    CompositionQuality quality;
+};
+
+class FrameScheduler
+{
+public:
+    // Composes inputs into output at the given quality. Levels the composer
+    // does not support may be treated as the best one it does.
+    typedef std::function<void(std::vector<cv::Mat>& inputs, cv::Mat& output,
+                               CompositionQuality quality)> ComposeCallback;
+    // Receives each composed frame with the capture time of its inputs. The
+    // output is reused for the next frame once the sink returns.
+    typedef std::function<void(const cv::Mat& output, int64_t capture_time_us)> SinkCallback;
+
+    FrameScheduler(const ComposeCallback& compose, const SinkCallback& sink,
+                   const FrameSchedulerOptions& options = FrameSchedulerOptions());
+    ~FrameScheduler();
+
+    // Starts the compose thread.
+    void Start();
+
+    // Stops the compose thread for good. Sets already waiting are still
+    // composed, later ones are ignored.
+    void Stop();
+
+    // Copies frames into the queue, from the capture thread only. Never
+    // blocks: if the queue is full the oldest set is replaced. capture_time_us
+    // is on the Now() clock.
+    void Submit(const std::vector<cv::Mat>& frames, int64_t capture_time_us);
+
+    FrameSchedulerStats stats() const;
+
+    // Monotonic clock of the capture times, in microseconds.
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct FrameSet
+    {
+        std::vector<cv::Mat> images;
+        int64_t capture_time_us;
+    };
+
+    void ComposeLoop();
+
+    // Updates the statistics and the quality after a frame composed with
+    // latency_us.
+    void Account(int64_t latency_us);
+
+    ComposeCallback compose_;
+    SinkCallback sink_;
+    FrameSchedulerOptions options_;
+    FrameRing<FrameSet> ring_;
+    std::thread thread_;
+
+    int consecutive_misses_;
+    int consecutive_hits_;
+    std::atomic<int64_t> submitted_;
+    mutable std::mutex stats_mutex_;
+    FrameSchedulerStats stats_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline FrameScheduler::FrameScheduler(const ComposeCallback& compose,
+                                      const SinkCallback& sink,
+                                      const FrameSchedulerOptions& options)
+    : compose_(compose), sink_(sink), options_(options),
+      ring_(options.queue_capacity, FRAME_RING_OVERWRITE_OLDEST),
+      consecutive_misses_(0), consecutive_hits_(0), submitted_(0)
+{
+    stats_.submitted = 0;
+    stats_.composed = 0;
+    stats_.overwritten = 0;
+    stats_.stale = 0;
+    stats_.deadline_misses = 0;
+    stats_.last_latency_us = 0;
+    stats_.max_latency_us = 0;
+    stats_.quality = QUALITY_FULL;
+}
+
+inline FrameScheduler::~FrameScheduler()
+{
+    Stop();
+}
+
+inline void FrameScheduler::Start()
+{
+    if (!thread_.joinable())
+        thread_ = std::thread(&FrameScheduler::ComposeLoop, this);
+}
+
+inline void FrameScheduler::Stop()
+{
+    ring_.Close();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+inline void FrameScheduler::Submit(const std::vector<cv::Mat>& frames,
+                                   int64_t capture_time_us)
+{
+    FrameSet* set = ring_.AcquireWrite();
+    if (set == NULL)
+        return;
+    // copyTo reuses the slot buffers once they have the camera size.
+    set->images.resize(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i)
+        frames[i].copyTo(set->images[i]);
+    set->capture_time_us = capture_time_us;
+    ring_.PublishWrite();
+    ++submitted_;
+}
+
+inline void FrameScheduler::ComposeLoop()
+{
+    const int64_t budget_us = options_.latency_budget_ms * 1000LL;
+    cv::Mat output;
+    while (FrameSet* set = ring_.AcquireRead())
+    {
+        // Composing a set that already missed its deadline only delays the
+        // newer one behind it.
+        if (Now() - set->capture_time_us > budget_us && ring_.size() > 0)
+        {
+            ring_.ReleaseRead();
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            ++stats_.stale;
+            continue;
+        }
+
+        compose_(set->images, output, stats_.quality);
+        const int64_t capture_time_us = set->capture_time_us;
+        ring_.ReleaseRead();
+
+        sink_(output, capture_time_us);
+        Account(Now() - capture_time_us);
+    }
+}
+
+inline void FrameScheduler::Account(int64_t latency_us)
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    ++stats_.composed;
+    stats_.last_latency_us = latency_us;
+    stats_.max_latency_us = std::max(stats_.max_latency_us, latency_us);
+
+    if (latency_us > options_.latency_budget_ms * 1000LL)
+    {
+        ++stats_.deadline_misses;
+        consecutive_hits_ = 0;
+        if (++consecutive_misses_ >= options_.degrade_after_misses &&
+            options_.allow_degrade && stats_.quality < QUALITY_LOWEST)
+        {
+            stats_.quality = static_cast<CompositionQuality>(stats_.quality + 1);
+            consecutive_misses_ = 0;
+        }
+    }
+    else
+    {
+        consecutive_misses_ = 0;
+        if (++consecutive_hits_ >= options_.recover_after_hits &&
+            stats_.quality > QUALITY_FULL)
+        {
+            stats_.quality = static_cast<CompositionQuality>(stats_.quality - 1);
+            consecutive_hits_ = 0;
+        }
+    }
+}
+
+inline FrameSchedulerStats FrameScheduler::stats() const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    FrameSchedulerStats stats = stats_;
+    stats.submitted = submitted_;
+    stats.overwritten = ring_.dropped();
+    return stats;
+}
+
+#endif  // FRAME_SCHEDULER_H_
@@ -0,0 +1,287 @@
+// Exposure gain estimation off the frame loop.
+//
+// The gains that equalize the brightness of the cameras only drift slowly, so
+// they do not need to be estimated on every frame. GainEstimator samples the
+// warped camera images at a low rate, gathers the overlap statistics on a
+// strided subsample of the overlap pixels on its own thread, solves for the
+// gains and smooths them over time to avoid flicker. The frame loop only
+// offers its images and reads back the latest gains, e.g. as the
+// GatherTone::gain of each camera in RemapGather().
+
+#ifndef GAIN_ESTIMATOR_H_
+#define GAIN_ESTIMATOR_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+// Sums over the pixels where two cameras overlap, indexed [i * num_cameras + j]
+// for the overlap of cameras i and j.
+struct OverlapStatistics
+{
+    int num_cameras;
+    // Number of pixels of the overlap.
+    std::vector<int64_t> count;
+    // Sum of the intensities of camera i over its overlap with camera j.
+    std::vector<double> sum;
+
+    void Reset(int cameras)
+    {
+        num_cameras = cameras;
+        count.assign(cameras * cameras, 0);
+        sum.assign(cameras * cameras, 0.0);
+    }
+
+    // Mean intensity of camera i over its overlap with camera j.
+    double mean(int i, int j) const
+    {
+        const int k = i * num_cameras + j;
+        return count[k] > 0 ? sum[k] / count[k] : 0.0;
+    }
+};
+
+// Accumulates the overlap statistics of the warped images (CV_8UC3, all of
+// the canvas size) whose valid pixels are given by masks (CV_8UC1). Only one
+// pixel in stride is visited along each axis.
+inline void ComputeOverlapStatistics(const std::vector<cv::Mat>& warped,
+                                     const std::vector<cv::Mat>& masks,
+                                     int stride, OverlapStatistics* stats)
+{
+    const int n = static_cast<int>(warped.size());
+    stats->Reset(n);
+    if (stride < 1)
+        stride = 1;
+
+    std::vector<int> covering(n);
+    for (int row = 0; row < warped[0].rows; row += stride)
+    {
+        for (int col = 0; col < warped[0].cols; col += stride)
+        {
+            int num_covering = 0;
+            for (int i = 0; i < n; ++i)
+                if (masks[i].at<uchar>(row, col))
+                    covering[num_covering++] = i;
+            if (num_covering < 2)
+                continue;
+            for (int a = 0; a < num_covering; ++a)
+            {
+                const int i = covering[a];
+                const cv::Vec3b& p = warped[i].at<cv::Vec3b>(row, col);
+                const double intensity = (p[0] + p[1] + p[2]) / 3.0;
+                for (int b = 0; b < num_covering; ++b)
+                {
+                    if (a == b)
+                        continue;
+                    const int k = i * n + covering[b];
+                    stats->sum[k] += intensity;
+                    ++stats->count[k];
+                }
+            }
+        }
+    }
+}
+
+// Solves for the gains g_i minimizing
+//   sum_ij N_ij (alpha (g_i I_ij - g_j I_ji)^2 + beta (1 - g_i)^2)
+// where N_ij is the overlap size and I_ij the mean intensity of camera i over
+// it, as in cv::detail::GainCompensator. alpha is 1 / sigma_N^2 and beta
+// 1 / sigma_g^2 for the intensity and gain standard deviations. A camera
+// without overlap keeps a gain of 1.
+inline void SolveGains(const OverlapStatistics& stats, double alpha, double beta,
+                       std::vector<double>* gains)
+{
+    const int n = stats.num_cameras;
+    cv::Mat_<double> A(n, n, 0.0);
+    cv::Mat_<double> b(n, 1, 0.0);
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            if (i == j)
+                continue;
+            const double N = static_cast<double>(stats.count[i * n + j]);
+            const double I_ij = stats.mean(i, j);
+            const double I_ji = stats.mean(j, i);
+            b(i) += beta * N;
+            A(i, i) += beta * N + 2 * alpha * I_ij * I_ij * N;
+            A(i, j) -= 2 * alpha * I_ij * I_ji * N;
+        }
+        if (A(i, i) == 0.0)
+        {
+            A(i, i) = 1.0;
+            b(i) = 1.0;
+        }
+    }
+
+    cv::Mat_<double> solution;
+    gains->assign(n, 1.0);
+    if (cv::solve(A, b, solution, cv::DECOMP_CHOLESKY))
+        for (int i = 0; i < n; ++i)
+            (*gains)[i] = solution(i);
+}
+
+struct GainEstimatorOptions
+{
+    // Estimations per second at most.
+    double rate;
+    // Pixel stride of the overlap subsample.
+    int stride;
+    // Weight of a new estimate in the exponential moving average, 1 disables
+    // smoothing.
+    double smoothing;
+    // Weights of SolveGains().
+    double alpha;
+    double beta;
+
+    GainEstimatorOptions()
+    {
+        rate = 2.0;
+        stride = 4;
+        smoothing = 0.2;
+        alpha = 0.01;  // sigma_N = 10
+        beta = 100.0;  // sigma_g = 0.1
+    }
+};
+
+class GainEstimator
+{
+public:
+    GainEstimator();
+    ~GainEstimator();
+
+    // Starts the estimation thread for cameras whose warped images are valid
+    // where masks (CV_8UC1, canvas size) are non zero.
+    void Start(const std::vector<cv::Mat>& masks,
+               const GainEstimatorOptions& options = GainEstimatorOptions());
+
+    void Stop();
+
+    // Called by the frame loop with the warped images of a frame. They are
+    // copied only if an estimation is due and the thread is idle, otherwise
+    // this returns false right away.
+    bool Offer(const std::vector<cv::Mat>& warped);
+
+    // Copies the latest smoothed gains into gains, all 1 until the first
+    // estimation. Does not allocate once gains has the camera count.
+    void LatestGains(std::vector<double>* gains) const;
+
+    // Number of estimations done.
+    int estimations() const;
+
+private:
+    void EstimateLoop();
+
+    GainEstimatorOptions options_;
+    std::vector<cv::Mat> masks_;
+
+    // Images of the pending estimation, reused from one to the next.
+    std::vector<cv::Mat> samples_;
+    bool pending_;
+    bool stop_;
+    std::chrono::steady_clock::time_point next_due_;
+
+    std::vector<double> gains_;
+    int estimations_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread thread_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline GainEstimator::GainEstimator()
+    : pending_(false), stop_(false), estimations_(0) {}
+
+inline GainEstimator::~GainEstimator()
+{
+    Stop();
+}
+
+inline void GainEstimator::Start(const std::vector<cv::Mat>& masks,
+                                 const GainEstimatorOptions& options)
+{
+    Stop();
+    options_ = options;
+    masks_ = masks;
+    samples_.resize(masks.size());
+    gains_.assign(masks.size(), 1.0);
+    estimations_ = 0;
+    pending_ = false;
+    stop_ = false;
+    next_due_ = std::chrono::steady_clock::now();
+    thread_ = std::thread(&GainEstimator::EstimateLoop, this);
+}
+
+inline void GainEstimator::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+inline bool GainEstimator::Offer(const std::vector<cv::Mat>& warped)
+{
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock() || pending_ || stop_ || warped.size() != samples_.size() ||
+        std::chrono::steady_clock::now() < next_due_)
+        return false;
+
+    for (size_t i = 0; i < warped.size(); ++i)
+        warped[i].copyTo(samples_[i]);
+    pending_ = true;
+    next_due_ = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(static_cast<int64_t>(1e6 / options_.rate));
+    lock.unlock();
+    wake_.notify_one();
+    return true;
+}
+
+inline void GainEstimator::LatestGains(std::vector<double>* gains) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    gains->assign(gains_.begin(), gains_.end());
+}
+
+inline int GainEstimator::estimations() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return estimations_;
+}
+
+inline void GainEstimator::EstimateLoop()
+{
+    OverlapStatistics stats;
+    std::vector<double> estimate;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this] { return stop_ || pending_; });
+            if (stop_)
+                return;
+        }
+
+        // samples_ belongs to this thread while pending_ is set.
+        ComputeOverlapStatistics(samples_, masks_, options_.stride, &stats);
+        SolveGains(stats, options_.alpha, options_.beta, &estimate);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double w = estimations_ == 0 ? 1.0 : options_.smoothing;
+        for (size_t i = 0; i < gains_.size(); ++i)
+            gains_[i] = (1.0 - w) * gains_[i] + w * estimate[i];
+        ++estimations_;
+        pending_ = false;
+    }
+}
+
+#endif  // GAIN_ESTIMATOR_H_
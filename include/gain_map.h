@@ -0,0 +1,298 @@
+// Spatially varying exposure gains.
+//
+// A scalar gain per camera cannot compensate vignetting or exposure gradients
+// across a fisheye view. GainMaps solves one gain per camera and per cell of
+// a coarse grid laid over the canvas (cell_size pixels, 8 by default) from
+// the overlap statistics of the cells: in every overlap cell, each camera is
+// brought to the mean intensity of the cameras covering it. Cells without
+// overlap take the gains diffused from the solved ones with
+// DiffuseFromMaskedRegion(), and the maps are brought back to full resolution
+// with BiLinearDoubleSizeNoAlloc(). The full resolution map of a camera is
+// meant to be used as the GatherTone::weights of RemapGather(), so applying it
+// costs a multiply in a pass that is done anyway.
+//
+// The statistics are taken from the warped images as corrected by the
+// current maps, so a solution is a correction relative to them: Solve()
+// multiplies it into the maps rather than replacing them.
+
+#ifndef GAIN_MAP_H_
+#define GAIN_MAP_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+#include "color_statistics.h"
+#include "image_diffuse/image_diffuse.h"
+
+struct GainMapOptions
+{
+    // Size of a grid cell in canvas pixels, a power of two.
+    int cell_size;
+    // Pixel stride of the statistics subsample.
+    int stride;
+    // Minimum number of samples of a cell to solve its gain.
+    int min_samples;
+    // Gains are clamped to [min_gain, max_gain].
+    float min_gain;
+    float max_gain;
+    // Weight of a new solution in the exponential moving average of the
+    // maps, 1 disables smoothing.
+    float smoothing;
+
+    GainMapOptions()
+    {
+        cell_size = 8;
+        stride = 2;
+        min_samples = 4;
+        min_gain = 0.5f;
+        max_gain = 2.0f;
+        smoothing = 0.3f;
+    }
+};
+
+// Sets mask (CV_8UC1, rect size) to 255 at the pixels of camera, placed on
+// the canvas at rect, that coverage (see BuildCoverageMap()) shows covered by
+// another camera as well, 0 elsewhere: the mask of the ColorMomentIntegral
+// that GainMaps::Accumulate() queries.
+inline void OverlapMask(const cv::Mat& coverage, int camera, cv::Rect rect,
+                        cv::Mat* mask)
+{
+    mask->create(rect.size(), CV_8UC1);
+    mask->setTo(0);
+    const uchar self = static_cast<uchar>(1 << camera);
+    const cv::Rect inside = rect & cv::Rect(cv::Point(0, 0), coverage.size());
+    for (int row = inside.y; row < inside.br().y; ++row)
+    {
+        const uchar* cover = coverage.ptr<uchar>(row);
+        uchar* out = mask->ptr<uchar>(row - rect.y);
+        for (int col = inside.x; col < inside.br().x; ++col)
+            if ((cover[col] & self) && (cover[col] & ~self))
+                out[col - rect.x] = 255;
+    }
+}
+
+class GainMaps
+{
+public:
+    typedef cv::Mat_<cv::Vec<float, 1>> GainMap;
+
+    GainMaps() : num_cameras_(0), solved_(false) {}
+
+    // Sets up the grids of num_cameras cameras on a canvas of canvas_size.
+    void Reset(int num_cameras, cv::Size canvas_size,
+               const GainMapOptions& options = GainMapOptions());
+
+    // Adds the overlap statistics of a frame. warped holds the CV_8UC3 warped
+    // image of each camera corrected with the current maps, placed on the
+    // canvas at rects, and coverage the cameras valid at each canvas pixel
+    // (see BuildCoverageMap()).
+    void Accumulate(const std::vector<cv::Mat>& warped,
+                    const std::vector<cv::Rect>& rects, const cv::Mat& coverage);
+
+    // Same from the color moments of the warped images: overlap[i] is the
+    // integral of the warped image of camera i, placed at rects[i], with the
+    // mask of OverlapMask(). Each cell is a constant time query over all of
+    // its pixels, so the integrals of a frame can also serve other regions,
+    // e.g. the ColorTransformOptions ROI. Cells are rounded to the grid of
+    // the integrals, exact if their cell size divides the map cell size and
+    // the rects lie on their grid.
+    void Accumulate(const std::vector<ColorMomentIntegral>& overlap,
+                    const std::vector<cv::Rect>& rects);
+
+    // Solves the residual gains of the accumulated statistics, multiplies
+    // them into the maps with smoothing and clears the statistics.
+    void Solve();
+
+    // Returns the low resolution map of camera, one gain per cell.
+    const GainMap& low_res(int camera) const { return maps_[camera]; }
+
+    // Upsamples the map of camera to full resolution and crops it to rect,
+    // into weights (CV_32FC1, rect size). Parts of rect outside the canvas get
+    // a gain of 1.
+    void Upsample(int camera, cv::Rect rect, cv::Mat* weights);
+
+private:
+    GainMapOptions options_;
+    int num_cameras_;
+    cv::Size canvas_size_;
+    cv::Size grid_size_;
+    bool solved_;
+
+    // Per camera and cell: sum and number of overlap samples.
+    std::vector<cv::Mat_<double>> sums_;
+    std::vector<cv::Mat_<int>> counts_;
+    std::vector<GainMap> maps_;
+
+    // Buffers of Solve() and Upsample().
+    GainMap solution_;
+    cv::Mat_<cv::Vec<float, 1>> known_;
+    std::vector<GainMap> pyramid_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline void GainMaps::Reset(int num_cameras, cv::Size canvas_size,
+                            const GainMapOptions& options)
+{
+    // Upsample() doubles the grid up to the cell size.
+    CV_Assert(options.cell_size > 0 && (options.cell_size & (options.cell_size - 1)) == 0);
+    options_ = options;
+    num_cameras_ = num_cameras;
+    canvas_size_ = canvas_size;
+    grid_size_ = cv::Size((canvas_size.width + options.cell_size - 1) / options.cell_size,
+                          (canvas_size.height + options.cell_size - 1) / options.cell_size);
+    solved_ = false;
+
+    sums_.resize(num_cameras);
+    counts_.resize(num_cameras);
+    maps_.resize(num_cameras);
+    for (int i = 0; i < num_cameras; ++i)
+    {
+        sums_[i].create(grid_size_);
+        sums_[i] = 0.0;
+        counts_[i].create(grid_size_);
+        counts_[i] = 0;
+        maps_[i].create(grid_size_);
+        maps_[i] = cv::Vec<float, 1>(1.0f);
+    }
+    solution_.create(grid_size_);
+    known_.create(grid_size_);
+
+    // Each level doubles the previous one, up to the cell size.
+    pyramid_.clear();
+    for (int size = 2; size <= options.cell_size; size *= 2)
+        pyramid_.push_back(GainMap(grid_size_.height * size, grid_size_.width * size));
+}
+
+inline void GainMaps::Accumulate(const std::vector<cv::Mat>& warped,
+                                 const std::vector<cv::Rect>& rects,
+                                 const cv::Mat& coverage)
+{
+    const int stride = std::max(options_.stride, 1);
+    for (int i = 0; i < num_cameras_ && i < (int)warped.size(); ++i)
+    {
+        const cv::Rect rect = rects[i] & cv::Rect(cv::Point(0, 0), canvas_size_);
+        for (int row = rect.y - rect.y % stride; row < rect.br().y; row += stride)
+        {
+            if (row < rect.y)
+                continue;
+            const uchar* cover = coverage.ptr<uchar>(row);
+            const cv::Vec3b* pixels = warped[i].ptr<cv::Vec3b>(row - rects[i].y);
+            double* sums = sums_[i][row / options_.cell_size];
+            int* counts = counts_[i][row / options_.cell_size];
+            for (int col = rect.x - rect.x % stride; col < rect.br().x; col += stride)
+            {
+                if (col < rect.x)
+                    continue;
+                // Only pixels of camera i seen by another camera as well.
+                const uchar others = cover[col] & ~(1 << i);
+                if (!(cover[col] & (1 << i)) || !others)
+                    continue;
+                const cv::Vec3b& p = pixels[col - rects[i].x];
+                sums[col / options_.cell_size] += (p[0] + p[1] + p[2]) / 3.0;
+                ++counts[col / options_.cell_size];
+            }
+        }
+    }
+}
+
+inline void GainMaps::Accumulate(const std::vector<ColorMomentIntegral>& overlap,
+                                 const std::vector<cv::Rect>& rects)
+{
+    const int cell = options_.cell_size;
+    ImageStatistics stats;
+    for (int i = 0; i < num_cameras_ && i < (int)overlap.size(); ++i)
+    {
+        const cv::Rect rect = rects[i] & cv::Rect(cv::Point(0, 0), canvas_size_);
+        for (int row = rect.y / cell; row * cell < rect.br().y; ++row)
+        {
+            for (int col = rect.x / cell; col * cell < rect.br().x; ++col)
+            {
+                const cv::Rect local =
+                    cv::Rect(col * cell, row * cell, cell, cell) - rects[i].tl();
+                if (!overlap[i].Statistics(local, 1.0, &stats))
+                    continue;
+                const int64_t count = overlap[i].Count(local);
+                sums_[i](row, col) +=
+                    count * (stats.mean[0] + stats.mean[1] + stats.mean[2]) / 3.0;
+                counts_[i](row, col) += static_cast<int>(count);
+            }
+        }
+    }
+}
+
+inline void GainMaps::Solve()
+{
+    for (int i = 0; i < num_cameras_; ++i)
+    {
+        int num_known = 0;
+        for (int row = 0; row < grid_size_.height; ++row)
+        {
+            for (int col = 0; col < grid_size_.width; ++col)
+            {
+                known_(row, col)[0] = -1.0f;
+                solution_(row, col)[0] = 1.0f;
+                if (counts_[i](row, col) < options_.min_samples)
+                    continue;
+
+                // Target of the cell: mean over the cameras sampled in it.
+                double target = 0.0;
+                int num_target = 0;
+                for (int j = 0; j < num_cameras_; ++j)
+                {
+                    if (counts_[j](row, col) >= options_.min_samples)
+                    {
+                        target += sums_[j](row, col) / counts_[j](row, col);
+                        ++num_target;
+                    }
+                }
+                const double mean = sums_[i](row, col) / counts_[i](row, col);
+                if (num_target < 2 || mean <= 0.0)
+                    continue;
+                solution_(row, col)[0] = std::min(options_.max_gain, std::max(
+                    options_.min_gain, static_cast<float>(target / num_target / mean)));
+                known_(row, col)[0] = 1.0f;
+                ++num_known;
+            }
+        }
+        // Spread the solved cells over the rest of the grid.
+        if (num_known > 0 && num_known < grid_size_.area())
+            DiffuseFromMaskedRegion(known_, &solution_);
+
+        // Moving the maps by w of the way to map * solution scales them by
+        // 1 + w (solution - 1).
+        const float w = solved_ ? options_.smoothing : 1.0f;
+        for (int row = 0; row < grid_size_.height; ++row)
+        {
+            for (int col = 0; col < grid_size_.width; ++col)
+            {
+                float& gain = maps_[i](row, col)[0];
+                gain *= 1.0f + w * (solution_(row, col)[0] - 1.0f);
+                gain = std::min(options_.max_gain, std::max(options_.min_gain, gain));
+            }
+        }
+
+        sums_[i] = 0.0;
+        counts_[i] = 0;
+    }
+    solved_ = true;
+}
+
+inline void GainMaps::Upsample(int camera, cv::Rect rect, cv::Mat* weights)
+{
+    const GainMap* level = &maps_[camera];
+    for (size_t l = 0; l < pyramid_.size(); ++l)
+    {
+        BiLinearDoubleSizeNoAlloc<float, 1>(*level, &pyramid_[l]);
+        level = &pyramid_[l];
+    }
+
+    weights->create(rect.size(), CV_32FC1);
+    weights->setTo(1.0f);
+    const cv::Rect inside = rect & cv::Rect(cv::Point(0, 0), canvas_size_);
+    if (inside.area() > 0)
+        cv::Mat(*level)(inside).copyTo((*weights)(inside - rect.tl()));
+}
+
+#endif  // GAIN_MAP_H_
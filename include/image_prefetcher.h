@@ -0,0 +1,197 @@
+// Loads a list of image files ahead of their consumer.
+//
+// Upcoming files are decoded with imread on a small pool of threads into a
+// ring of reusable Mats and handed out strictly in list order, so decoding
+// overlaps with whatever the consumer does with the previous images
+// (compositing, encoding) and uses otherwise idle cores.
+
+#ifndef IMAGE_PREFETCHER_H_
+#define IMAGE_PREFETCHER_H_
+
+#include <stdio.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+class ImagePrefetcher
+{
+public:
+    ImagePrefetcher();
+    ~ImagePrefetcher();
+
+    // Starts loading names on num_threads threads (0 uses one per core, up to
+    // ring_size) into a ring of ring_size images. If output_size is not
+    // empty, images are resized to it on the loading threads, into buffers
+    // that are reused from one image to the next.
+    void Start(const std::vector<std::string>& names, int num_threads = 0,
+               int ring_size = 8, cv::Size output_size = cv::Size());
+
+    // Waits for the next image in list order. image shares the ring buffer and
+    // stays valid until the next call to Next(); clone it to keep it longer.
+    // Returns false after the last image or if a file cannot be read, which
+    // failed() tells apart.
+    bool Next(cv::Mat& image);
+
+    // True once Next() stopped on a file that cannot be read.
+    bool failed() const { return failed_; }
+
+    // Stops the loading threads. Called by the destructor.
+    void Stop();
+
+private:
+    struct Slot
+    {
+        cv::Mat image;
+        int index;
+        bool ready;
+        bool failed;
+    };
+
+    void LoadLoop();
+
+    // Index of the first image that cannot be loaded yet because its slot is
+    // still in use. Must be called with mutex_ held.
+    int LoadLimit() const;
+
+    std::vector<std::string> names_;
+    std::vector<Slot> slots_;
+    cv::Size output_size_;
+
+    // Next image to claim by a loader and next image to hand out.
+    int next_to_load_;
+    int next_to_consume_;
+    bool stop_;
+    bool failed_;
+
+    std::mutex mutex_;
+    std::condition_variable slot_free_;
+    std::condition_variable slot_ready_;
+    std::vector<std::thread> threads_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline ImagePrefetcher::ImagePrefetcher()
+    : next_to_load_(0), next_to_consume_(0), stop_(false), failed_(false) {}
+
+inline ImagePrefetcher::~ImagePrefetcher()
+{
+    Stop();
+}
+
+inline void ImagePrefetcher::Start(const std::vector<std::string>& names,
+                                   int num_threads, int ring_size,
+                                   cv::Size output_size)
+{
+    Stop();
+    names_ = names;
+    output_size_ = output_size;
+    slots_.resize(std::max(ring_size, 1));
+    for (size_t i = 0; i < slots_.size(); ++i)
+    {
+        slots_[i].index = -1;
+        slots_[i].ready = false;
+        slots_[i].failed = false;
+    }
+    next_to_load_ = 0;
+    next_to_consume_ = 0;
+    stop_ = false;
+    failed_ = false;
+
+    if (num_threads <= 0)
+        num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, (int)slots_.size());
+    for (int i = 0; i < num_threads; ++i)
+        threads_.push_back(std::thread(&ImagePrefetcher::LoadLoop, this));
+}
+
+inline void ImagePrefetcher::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    slot_free_.notify_all();
+    slot_ready_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+        threads_[i].join();
+    threads_.clear();
+}
+
+inline int ImagePrefetcher::LoadLimit() const
+{
+    // The image last returned by Next() still occupies its slot.
+    int held = std::max(next_to_consume_ - 1, 0);
+    return held + static_cast<int>(slots_.size());
+}
+
+inline void ImagePrefetcher::LoadLoop()
+{
+    cv::Mat decoded;
+    while (true)
+    {
+        int index;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            slot_free_.wait(lock, [this] {
+                return stop_ || next_to_load_ >= (int)names_.size() ||
+                       next_to_load_ < LoadLimit();
+            });
+            if (stop_ || next_to_load_ >= (int)names_.size())
+                return;
+            index = next_to_load_++;
+        }
+
+        // The claimed slot belongs to this thread until it is marked ready.
+        Slot& slot = slots_[index % slots_.size()];
+        decoded = cv::imread(names_[index]);
+        slot.failed = decoded.empty();
+        if (slot.failed)
+            printf("error: cannot read image %s\n", names_[index].c_str());
+        else if (output_size_.area() > 0 && decoded.size() != output_size_)
+            cv::resize(decoded, slot.image, output_size_);
+        else
+            decoded.copyTo(slot.image);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slot.index = index;
+            slot.ready = true;
+        }
+        slot_ready_.notify_all();
+    }
+}
+
+inline bool ImagePrefetcher::Next(cv::Mat& image)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const int index = next_to_consume_;
+    if (index >= (int)names_.size())
+        return false;
+
+    Slot& slot = slots_[index % slots_.size()];
+    slot_ready_.wait(lock, [&] {
+        return stop_ || (slot.ready && slot.index == index);
+    });
+    if (stop_)
+        return false;
+    if (slot.failed)
+    {
+        failed_ = true;
+        return false;
+    }
+
+    image = slot.image;
+    slot.ready = false;
+    ++next_to_consume_;
+    lock.unlock();
+    slot_free_.notify_all();
+    return true;
+}
+
+#endif  // IMAGE_PREFETCHER_H_
@@ -0,0 +1,253 @@
+// Keyframe index of a recorded video, used for random access.
+//
+// The index lists every keyframe of a video stream together with its frame
+// number and position in the file. It is built by demuxing the file once,
+// without decoding, and cached in a sidecar file next to the video so that
+// later opens only read the sidecar. A seek then jumps straight to the GOP
+// holding the target frame and decodes at most one GOP forward.
+//
+// Frames are numbered in presentation order, from the packet timestamps, so
+// that streams with B-frames are indexed like the frames the decoder outputs.
+// Keyframes opening a GOP whose leading frames reference the previous GOP
+// (open GOPs) are not clean seek points and are skipped by Lookup(). Without
+// timestamps, packets are numbered in decode order, which is only correct
+// for streams without reordering.
+
+#ifndef KEYFRAME_INDEX_H_
+#define KEYFRAME_INDEX_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+struct KeyframeEntry {
+    // Presentation index of the keyframe, counted from 0.
+    int     frame;
+    // Timestamps of the keyframe packet in the stream time base, possibly
+    // AV_NOPTS_VALUE.
+    int64_t pts;
+    int64_t dts;
+    // Byte offset of the packet in the file, -1 if unknown.
+    int64_t pos;
+    // False if frames decoded after the keyframe are presented before it, in
+    // which case decoding cannot start there.
+    bool    clean;
+};
+
+class KeyframeIndex {
+public:
+    KeyframeIndex() : frame_count_(0), file_size_(-1), file_mtime_(-1) {}
+
+    // Builds the index of the nth (1-based) video stream of filename by
+    // reading its packets. Returns false if the file cannot be demuxed.
+    bool Build(const char *filename, int nth);
+
+    // Reads an index written by Save(). Returns false if the file is missing
+    // or malformed.
+    bool Load(const std::string &path);
+
+    // Writes the index to path. Returns false on I/O error.
+    bool Save(const std::string &path) const;
+
+    // Loads the sidecar of filename if it matches the size and modification
+    // time of the video, otherwise builds the index and writes the sidecar for
+    // the next open. Failure to write the sidecar is not an error.
+    bool LoadOrBuild(const char *filename, int nth = 1);
+
+    // Returns the last clean keyframe at or before target_frame, NULL if the
+    // index is empty or target_frame precedes the first clean keyframe.
+    const KeyframeEntry *Lookup(int target_frame) const;
+
+    // Path of the sidecar file cached next to filename.
+    static std::string SidecarPath(const char *filename) {
+        return std::string(filename) + ".kfi";
+    }
+
+    bool empty() const { return entries_.empty(); }
+
+    // Total number of packets of the indexed stream.
+    int frame_count() const { return frame_count_; }
+
+    const std::vector<KeyframeEntry> &entries() const { return entries_; }
+
+private:
+    // Reads the size and modification time (in seconds) of filename, -1 if
+    // it cannot be read.
+    static void FileStamp(const char *filename, int64_t *size, int64_t *mtime);
+
+    std::vector<KeyframeEntry> entries_;
+    int     frame_count_;
+    // Size and modification time of the indexed video, used to detect a
+    // stale sidecar.
+    int64_t file_size_;
+    int64_t file_mtime_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline void KeyframeIndex::FileStamp(const char *filename, int64_t *size,
+                                     int64_t *mtime) {
+    struct stat info;
+    if (stat(filename, &info) != 0) {
+        *size = -1;
+        *mtime = -1;
+        return;
+    }
+    *size = static_cast<int64_t>(info.st_size);
+    *mtime = static_cast<int64_t>(info.st_mtime);
+}
+
+inline bool KeyframeIndex::Build(const char *filename, int nth) {
+    entries_.clear();
+    frame_count_ = 0;
+    FileStamp(filename, &file_size_, &file_mtime_);
+
+    AVFormatContext *format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, filename, NULL, NULL) < 0)
+        return false;
+    if (avformat_find_stream_info(format_ctx, NULL) < 0) {
+        avformat_close_input(&format_ctx);
+        return false;
+    }
+
+    int stream_index = -1;
+    for (unsigned int i = 0, count = 0; i < format_ctx->nb_streams; ++i) {
+        if (format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            ++count == static_cast<unsigned int>(nth)) {
+            stream_index = i;
+            break;
+        }
+    }
+    if (stream_index < 0) {
+        avformat_close_input(&format_ctx);
+        return false;
+    }
+
+    // Only demux, the packets are never decoded. Keyframes are numbered in
+    // decode order first, pts of every packet are kept to renumber them.
+    std::vector<int64_t> pts;
+    std::vector<int> decode_index;
+    bool has_pts = true;
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    while (av_read_frame(format_ctx, &packet) >= 0) {
+        if (packet.stream_index == stream_index) {
+            if (packet.flags & AV_PKT_FLAG_KEY) {
+                KeyframeEntry entry;
+                entry.frame = frame_count_;
+                entry.pts = packet.pts;
+                entry.dts = packet.dts;
+                entry.pos = packet.pos;
+                entry.clean = true;
+                entries_.push_back(entry);
+                decode_index.push_back(frame_count_);
+            }
+            has_pts = has_pts && packet.pts != AV_NOPTS_VALUE;
+            pts.push_back(packet.pts);
+            ++frame_count_;
+        }
+        av_packet_unref(&packet);
+    }
+    avformat_close_input(&format_ctx);
+    if (!has_pts)
+        return true;
+
+    // A keyframe is clean if no later packet is presented before it.
+    int64_t later_min = INT64_MAX;
+    for (int i = static_cast<int>(entries_.size()) - 1, k = frame_count_ - 1;
+         i >= 0; --i) {
+        for (; k > decode_index[i]; --k)
+            later_min = std::min(later_min, pts[k]);
+        entries_[i].clean = later_min >= entries_[i].pts;
+    }
+
+    std::vector<int64_t> sorted(pts);
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        entries_[i].frame = static_cast<int>(
+            std::lower_bound(sorted.begin(), sorted.end(), entries_[i].pts) -
+            sorted.begin());
+    }
+    // Presentation order may differ from decode order between GOPs.
+    std::sort(entries_.begin(), entries_.end(),
+              [](const KeyframeEntry &a, const KeyframeEntry &b) {
+                  return a.frame < b.frame;
+              });
+    return true;
+}
+
+inline bool KeyframeIndex::Load(const std::string &path) {
+    std::ifstream file(path.c_str());
+    std::string magic;
+    int version = 0;
+    size_t count = 0;
+    if (!(file >> magic >> version >> file_size_ >> file_mtime_ >>
+          frame_count_ >> count) ||
+        magic != "kfi" || version != 3)
+        return false;
+
+    entries_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        KeyframeEntry &entry = entries_[i];
+        if (!(file >> entry.frame >> entry.pts >> entry.dts >> entry.pos >>
+              entry.clean)) {
+            entries_.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool KeyframeIndex::Save(const std::string &path) const {
+    std::ofstream file(path.c_str());
+    file << "kfi 3 " << file_size_ << " " << file_mtime_ << " "
+         << frame_count_ << " " << entries_.size() << "\n";
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        const KeyframeEntry &entry = entries_[i];
+        file << entry.frame << " " << entry.pts << " " << entry.dts << " "
+             << entry.pos << " " << entry.clean << "\n";
+    }
+    return static_cast<bool>(file);
+}
+
+inline bool KeyframeIndex::LoadOrBuild(const char *filename, int nth) {
+    const std::string sidecar = SidecarPath(filename);
+    int64_t size, mtime;
+    FileStamp(filename, &size, &mtime);
+    if (nth == 1 && Load(sidecar) && file_size_ == size && file_mtime_ == mtime)
+        return true;
+    if (!Build(filename, nth))
+        return false;
+    // Only the first stream is cached, others are rare enough to rebuild.
+    if (nth == 1 && !Save(sidecar))
+        printf("warning: cannot write keyframe index %s\n", sidecar.c_str());
+    return true;
+}
+
+inline const KeyframeEntry *KeyframeIndex::Lookup(int target_frame) const {
+    // First keyframe strictly after target_frame, the one before it holds
+    // the GOP of target_frame.
+    std::vector<KeyframeEntry>::const_iterator it = std::upper_bound(
+        entries_.begin(), entries_.end(), target_frame,
+        [](int frame, const KeyframeEntry &entry) { return frame < entry.frame; });
+    while (it != entries_.begin()) {
+        --it;
+        if (it->clean)
+            return &*it;
+    }
+    return NULL;
+}
+
+#endif  // KEYFRAME_INDEX_H_
@@ -0,0 +1,427 @@
+// Reads the four camera recordings of a rig in lock step. Every stream is
+// decoded ahead of the caller on its own thread, and frames are matched across
+// streams by their timestamp() so that Composition always receives a coherent
+// set of four frames even if the recordings start at different times or some
+// frames were dropped during capture.
+
+#ifndef MULTI_STREAM_READER_H_
+#define MULTI_STREAM_READER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+#include "ffmpeg_audio_video_decoder.h"
+
+// What to do when a stream has no frame within the tolerance of the other
+// streams.
+enum SyncPolicy {
+    SYNC_DROP,     // Discard the incomplete set and try the next instant.
+    SYNC_REPEAT,   // Repeat the last frame delivered for the late stream.
+    SYNC_NEAREST,  // Use the closest frame available, whatever its distance.
+};
+
+struct MultiStreamReaderOptions
+{
+    // Ticks per second of all timestamps handled by the reader.
+    int timebase;
+    // Frames whose timestamps differ by at most this many ticks belong to the
+    // same capture instant.
+    int64 tolerance;
+    SyncPolicy policy;
+    // Number of decoded frames buffered ahead for each stream, at least 2 so
+    // that a stream can always look one frame past a stale one.
+    int prefetch_frames;
+    // Time Read() waits for a lagging stream before the policy is applied to
+    // it. Has no effect with SYNC_DROP, which always waits.
+    int max_wait_ms;
+    // Offset added to the timestamps of each stream, in ticks. Use it when the
+    // recordings do not share a common clock. Empty means no offset.
+    std::vector<int64> stream_offsets;
+    // Codec threading of every stream. A cpu_budget of 0 splits the host
+    // cores evenly between the streams. The streams are read sequentially,
+    // so no keyframe index is built by default.
+    FFMPEGDecoderOptions decoder_options;
+
+    MultiStreamReaderOptions()
+    {
+        timebase = 1000000;
+        tolerance = 20000; // 20 ms
+        policy = SYNC_NEAREST;
+        prefetch_frames = 8;
+        max_wait_ms = 100;
+        decoder_options.keyframe_index = false;
+    }
+};
+
+class MultiStreamReader
+{
+public:
+    MultiStreamReader();
+    ~MultiStreamReader();
+
+    // Opens one decoder per file and starts the prefetch threads.
+    // FFMPEGDecoder::InitFFPMEG() must have been called before.
+    bool Open(const std::vector<std::string>& filenames,
+              const MultiStreamReaderOptions& options);
+
+    // Stops the prefetch threads and releases the decoders.
+    void Close();
+
+    // Fills frames with one image per stream, all taken at the same instant,
+    // and sets timestamp to that instant. Returns false once any of the
+    // streams is exhausted.
+    bool Read(std::vector<cv::Mat>& frames, int64* timestamp);
+
+    int num_streams() const { return static_cast<int>(streams_.size()); }
+
+    // Number of incomplete frame sets discarded with SYNC_DROP.
+    int dropped_sets() const { return dropped_sets_; }
+
+    // Number of frames substituted by a repeated frame.
+    int repeated_frames() const { return repeated_frames_; }
+
+private:
+    struct TimedFrame
+    {
+        int64 timestamp;
+        cv::Mat image;
+    };
+
+    struct Stream
+    {
+        FFMPEGVideoDecoder decoder;
+        std::deque<TimedFrame> queue;
+        TimedFrame last;
+        // Buffers of frames that left the queue, decoded into again once
+        // nothing else references them.
+        std::vector<cv::Mat> spare;
+        int64 offset;
+        bool finished;
+        std::thread thread;
+    };
+
+    void PrefetchLoop(Stream* stream);
+
+    // Returns a buffer of stream->spare no one else holds, or an empty Mat.
+    // Must be called with mutex_ held.
+    cv::Mat TakeSpare(Stream* stream);
+
+    // Hands a frame leaving the queue back to the spare buffers of stream.
+    // Must be called with mutex_ held.
+    void Recycle(Stream* stream, const TimedFrame& frame);
+
+    // Moves the head of every queue to the frame closest to ref. Returns false
+    // if a queue may still receive a frame closer to ref.
+    bool AdvanceTo(int64 ref, bool timed_out);
+
+    MultiStreamReaderOptions options_;
+    std::vector<std::unique_ptr<Stream>> streams_;
+
+    std::mutex mutex_;
+    std::condition_variable frame_ready_;
+    std::condition_variable space_ready_;
+    bool stop_;
+
+    int dropped_sets_;
+    int repeated_frames_;
+};
+
+// -------------------------- implementation ------------------------------
+
+inline MultiStreamReader::MultiStreamReader()
+    : stop_(false), dropped_sets_(0), repeated_frames_(0) {}
+
+inline MultiStreamReader::~MultiStreamReader()
+{
+    Close();
+}
+
+inline bool MultiStreamReader::Open(const std::vector<std::string>& filenames,
+                                    const MultiStreamReaderOptions& options)
+{
+    Close();
+    options_ = options;
+    options_.prefetch_frames = std::max(options_.prefetch_frames, 2);
+    stop_ = false;
+    dropped_sets_ = 0;
+    repeated_frames_ = 0;
+
+    FFMPEGDecoderOptions decoder_options = options_.decoder_options;
+    if (decoder_options.cpu_budget <= 0)
+        decoder_options.cpu_budget = FFMPEGDecoderOptions::SharedCpuBudget(
+            static_cast<int>(filenames.size()));
+
+    for (size_t i = 0; i < filenames.size(); ++i)
+    {
+        std::unique_ptr<Stream> stream(new Stream);
+        stream->decoder.set_timebase(options_.timebase);
+        if (!stream->decoder.Open(filenames[i].c_str(), 1, "", decoder_options))
+        {
+            printf("error: cannot open video stream %s\n", filenames[i].c_str());
+            streams_.clear();
+            return false;
+        }
+        stream->offset = i < options_.stream_offsets.size() ?
+                         options_.stream_offsets[i] : 0;
+        stream->finished = false;
+        streams_.push_back(std::move(stream));
+    }
+
+    for (size_t i = 0; i < streams_.size(); ++i)
+        streams_[i]->thread = std::thread(&MultiStreamReader::PrefetchLoop,
+                                          this, streams_[i].get());
+    return true;
+}
+
+inline void MultiStreamReader::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    space_ready_.notify_all();
+    frame_ready_.notify_all();
+    for (size_t i = 0; i < streams_.size(); ++i)
+    {
+        if (streams_[i]->thread.joinable())
+            streams_[i]->thread.join();
+        streams_[i]->decoder.Reset();
+    }
+    streams_.clear();
+}
+
+inline void MultiStreamReader::PrefetchLoop(Stream* stream)
+{
+    FFMPEGVideoDecoder& decoder = stream->decoder;
+    const double frame_period = options_.timebase /
+        (decoder.frame_rate() > 0 ? decoder.frame_rate() : 30.0);
+    int64 decoded = 0;
+
+    while (true)
+    {
+        TimedFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            space_ready_.wait(lock, [&] {
+                return stop_ ||
+                    static_cast<int>(stream->queue.size()) < options_.prefetch_frames;
+            });
+            if (stop_)
+                return;
+            frame.image = TakeSpare(stream);
+        }
+
+        // Decoding runs outside the lock so the four streams progress in
+        // parallel.
+        bool ok = decoder.DecodeLoop() && decoder.have_frame();
+        if (ok)
+        {
+            frame.timestamp = decoder.timestamp();
+            if (frame.timestamp == AV_NOPTS_VALUE)
+                frame.timestamp = static_cast<int64>(decoded * frame_period);
+            ++decoded;
+            frame.timestamp += stream->offset;
+            ok = decoder.convert_avframe_to_mat(&frame.image);
+            decoder.MarkFrameConsumed();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (ok)
+                stream->queue.push_back(frame);
+            else
+                stream->finished = true;
+        }
+        frame_ready_.notify_all();
+        if (!ok)
+            return;
+    }
+}
+
+inline cv::Mat MultiStreamReader::TakeSpare(Stream* stream)
+{
+    std::vector<cv::Mat>& spare = stream->spare;
+    for (size_t i = 0; i < spare.size(); ++i)
+    {
+        // The spare list holds the only reference once the caller and
+        // stream->last let go of the frame.
+        if (spare[i].u != NULL && spare[i].u->refcount == 1)
+        {
+            cv::Mat image = spare[i];
+            spare[i] = spare.back();
+            spare.pop_back();
+            return image;
+        }
+    }
+    return cv::Mat();
+}
+
+inline void MultiStreamReader::Recycle(Stream* stream, const TimedFrame& frame)
+{
+    // Frames handed out by Read() and the last frame may still hold a
+    // buffer each, on top of the queue.
+    if (!frame.image.empty() &&
+        static_cast<int>(stream->spare.size()) < options_.prefetch_frames + 2)
+        stream->spare.push_back(frame.image);
+}
+
+inline bool MultiStreamReader::AdvanceTo(int64 ref, bool timed_out)
+{
+    bool settled = true;
+    for (size_t i = 0; i < streams_.size(); ++i)
+    {
+        std::deque<TimedFrame>& queue = streams_[i]->queue;
+        while (queue.size() >= 2 &&
+               std::abs(queue[1].timestamp - ref) <= std::abs(queue[0].timestamp - ref))
+        {
+            Recycle(streams_[i].get(), queue.front());
+            queue.pop_front();
+        }
+        // The only buffered frame is too old, but the next one may match.
+        if (queue.size() == 1 && queue[0].timestamp < ref - options_.tolerance &&
+            !streams_[i]->finished && !timed_out)
+            settled = false;
+    }
+    return settled;
+}
+
+inline bool MultiStreamReader::Read(std::vector<cv::Mat>& frames, int64* timestamp)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const size_t n = streams_.size();
+    if (n == 0)
+        return false;
+    frames.resize(n);
+
+    while (true)
+    {
+        // Wait until every stream has buffered a frame. Streams that are
+        // still empty after max_wait_ms are treated as lagging.
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(options_.max_wait_ms);
+        bool timed_out = false;
+        while (true)
+        {
+            bool all_ready = true;
+            for (size_t i = 0; i < n; ++i)
+            {
+                const Stream& stream = *streams_[i];
+                if (stream.queue.empty() && stream.finished)
+                    return false;
+                if (stream.queue.empty())
+                    all_ready = false;
+            }
+            if (all_ready || stop_)
+                break;
+            if (options_.policy == SYNC_DROP)
+            {
+                frame_ready_.wait(lock);
+                continue;
+            }
+            if (frame_ready_.wait_until(lock, deadline) == std::cv_status::timeout)
+            {
+                timed_out = true;
+                break;
+            }
+        }
+        if (stop_)
+            return false;
+
+        // The stream that started last defines the instant to match.
+        int64 ref = AV_NOPTS_VALUE;
+        for (size_t i = 0; i < n; ++i)
+            if (!streams_[i]->queue.empty())
+                ref = std::max(ref, streams_[i]->queue.front().timestamp);
+        if (ref == AV_NOPTS_VALUE)
+            continue;
+
+        bool settled = AdvanceTo(ref, timed_out);
+        space_ready_.notify_all();
+        if (!settled)
+        {
+            frame_ready_.wait_for(lock, std::chrono::milliseconds(options_.max_wait_ms));
+            continue;
+        }
+
+        // A lagging stream can only be substituted once it delivered a frame.
+        bool substitutable = true;
+        for (size_t i = 0; i < n; ++i)
+            if (streams_[i]->queue.empty() && streams_[i]->last.image.empty())
+                substitutable = false;
+        if (!substitutable)
+        {
+            frame_ready_.wait(lock);
+            continue;
+        }
+
+        bool complete = true;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const std::deque<TimedFrame>& queue = streams_[i]->queue;
+            if (queue.empty() ||
+                std::abs(queue.front().timestamp - ref) > options_.tolerance)
+                complete = false;
+        }
+
+        if (!complete && options_.policy == SYNC_DROP)
+        {
+            // Discard the frames matching ref; the stream that misses it has
+            // already moved on to a later instant.
+            for (size_t i = 0; i < n; ++i)
+            {
+                std::deque<TimedFrame>& queue = streams_[i]->queue;
+                if (!queue.empty() &&
+                    queue.front().timestamp <= ref + options_.tolerance)
+                {
+                    Recycle(streams_[i].get(), queue.front());
+                    queue.pop_front();
+                }
+            }
+            ++dropped_sets_;
+            space_ready_.notify_all();
+            continue;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            Stream& stream = *streams_[i];
+            bool matched = !stream.queue.empty() &&
+                std::abs(stream.queue.front().timestamp - ref) <= options_.tolerance;
+            bool use_last = !matched && !stream.last.image.empty() &&
+                (options_.policy == SYNC_REPEAT || stream.queue.empty());
+            if (use_last)
+            {
+                frames[i] = stream.last.image;
+                ++repeated_frames_;
+                continue;
+            }
+            // A frame ahead of ref stays queued for the next instant.
+            if (matched || stream.queue.front().timestamp < ref)
+            {
+                Recycle(&stream, stream.last);
+                stream.last = stream.queue.front();
+                stream.queue.pop_front();
+                frames[i] = stream.last.image;
+            }
+            else
+            {
+                frames[i] = stream.queue.front().image;
+            }
+        }
+        *timestamp = ref;
+        space_ready_.notify_all();
+        return true;
+    }
+}
+
+#endif  // MULTI_STREAM_READER_H_
@@ -0,0 +1,281 @@
+// Remap of a camera image with tone correction and overlap statistics fused
+// into the same pass.
+//
+// RemapGather() warps the image of one camera with cv::remap (bilinear) in
+// bands of rows and, while a band is still in cache, accumulates the overlap
+// statistics of GainEstimator for the next gain estimate from it and applies
+// the tone correction of the camera (a gain, or a 3x4 color matrix,
+// optionally modulated by a per-pixel weight map). The warped images are then
+// ready for blending without another pass over the canvas. The remap table
+// and masks of each camera are built once into a GatherCamera, and the band
+// buffers live in a GatherScratch kept by the caller.
+
+#ifndef REMAP_GATHER_H_
+#define REMAP_GATHER_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+#include "color_lut.h"
+#include "gain_estimator.h"
+
+// Tone correction applied by RemapGather(). The corrected pixel is
+//   weight(x, y) * gain * (use_matrix ? matrix * [p; 1] : p)
+// where p is the interpolated source pixel, in the channel order of the
+// images. If lut is set, it replaces gain and matrix, which should be baked
+// into it, and the corrected pixel is lut(weight(x, y) * p): the spatial
+// weights (vignetting, gain maps) apply to the raw pixel first.
+struct GatherTone
+{
+    float gain;
+    bool use_matrix;
+    cv::Matx34f matrix;
+    // Optional CV_32FC1 map of the warped image size, empty for 1.
+    cv::Mat weights;
+    // Optional per-camera color LUT, not owned.
+    const ColorLut3D* lut;
+
+    GatherTone()
+        : gain(1.0f), use_matrix(false), matrix(cv::Matx34f::eye()), lut(NULL) {}
+};
+
+// Overlap statistics gathered by RemapGather() calls for all cameras of a
+// frame.
+struct GatherStatistics
+{
+    // CV_8UC1 canvas-sized map whose bit i is set where camera i is valid,
+    // see BuildCoverageMap().
+    cv::Mat coverage;
+    // Pixel stride of the subsample used for the statistics.
+    int stride;
+    OverlapStatistics stats;
+
+    GatherStatistics() : stride(4) {}
+};
+
+// Rows warped per cv::remap() call by RemapGather(). A band of the warped,
+// corrected and weight images stays in cache between the passes over it.
+const int kRemapGatherBandRows = 16;
+
+// Sets valid (CV_8UC1, map size) to 255 where map (CV_32FC2) points inside a
+// source image of src_size and mask (CV_8UC1, optional) is set, 0 elsewhere:
+// the pixels that RemapGather() warps.
+inline void GatherValidMask(const cv::Mat& map, const cv::Mat& mask,
+                            cv::Size src_size, cv::Mat& valid)
+{
+    cv::inRange(map, cv::Scalar(0, 0),
+                cv::Scalar(src_size.width - 1, src_size.height - 1), valid);
+    if (!mask.empty())
+        cv::bitwise_and(valid, mask, valid);
+}
+
+// Remap table of one camera for RemapGather(), built once by
+// BuildGatherCamera() and only read afterwards, so any number of threads may
+// warp through it at the same time.
+struct GatherCamera
+{
+    // CV_32FC2 source coordinates of each warped pixel.
+    cv::Mat map;
+    // Size of the source images.
+    cv::Size src_size;
+    // Placement of the warped image on the canvas.
+    cv::Rect rect;
+    // CV_8UC1 masks of the map size: valid is 255 where the pixel is warped
+    // (see GatherValidMask()), invalid where it is set to 0.
+    cv::Mat valid;
+    cv::Mat invalid;
+    // True if every pixel is valid.
+    bool complete;
+
+    GatherCamera() : complete(true) {}
+};
+
+// Fills camera with map, src_size and rect and precomputes its masks from
+// mask (CV_8UC1, optional).
+inline void BuildGatherCamera(const cv::Mat& map, const cv::Mat& mask,
+                              cv::Size src_size, cv::Rect rect,
+                              GatherCamera* camera)
+{
+    camera->map = map;
+    camera->src_size = src_size;
+    camera->rect = rect;
+    GatherValidMask(map, mask, src_size, camera->valid);
+    cv::bitwise_not(camera->valid, camera->invalid);
+    camera->complete = cv::countNonZero(camera->invalid) == 0;
+}
+
+// Band buffers of RemapGather(), kept by the caller from one call to the next
+// so that steady-state warping does not allocate. Not shared between threads.
+struct GatherScratch
+{
+    cv::Mat warped;
+    cv::Mat pixels;
+    cv::Mat corrected;
+    cv::Mat weights;
+};
+
+// Builds the coverage map of GatherStatistics for cameras. A camera covers
+// the pixels of its valid mask, the same ones RemapGather() takes samples
+// from, so that the overlap counts of every pair of cameras agree. At most 8
+// cameras.
+inline void BuildCoverageMap(const std::vector<GatherCamera>& cameras,
+                             cv::Size canvas_size, cv::Mat* coverage)
+{
+    coverage->create(canvas_size, CV_8UC1);
+    coverage->setTo(0);
+    for (size_t i = 0; i < cameras.size() && i < 8; ++i)
+    {
+        const cv::Rect rect = cameras[i].rect & cv::Rect(cv::Point(0, 0), canvas_size);
+        if (rect.area() == 0)
+            continue;
+        cv::Mat roi = (*coverage)(rect);
+        cv::bitwise_or(roi, cv::Scalar(1 << i), roi,
+                       cameras[i].valid(rect - cameras[i].rect.tl()));
+    }
+}
+
+// Adds the overlap samples of a band of RemapGather(): warped and valid
+// hold the rows of the warped image from first_row on.
+inline void GatherBandStatistics(const cv::Mat& warped, const cv::Mat& valid,
+                                 int first_row, int camera, cv::Rect rect,
+                                 GatherStatistics* statistics)
+{
+    const int n = statistics->stats.num_cameras;
+    const int stride = std::max(statistics->stride, 1);
+    const cv::Mat& coverage = statistics->coverage;
+    const int begin = std::max(-rect.x, 0);
+    const int end = std::min(warped.cols, coverage.cols - rect.x);
+    for (int row = 0; row < warped.rows; ++row)
+    {
+        const int canvas_row = rect.y + first_row + row;
+        if (canvas_row < 0 || canvas_row >= coverage.rows || canvas_row % stride != 0)
+            continue;
+        const uchar* cover = coverage.ptr<uchar>(canvas_row);
+        const uchar* ok = valid.ptr<uchar>(row);
+        const cv::Vec3b* p = warped.ptr<cv::Vec3b>(row);
+        for (int col = begin; col < end; ++col)
+        {
+            const int canvas_col = rect.x + col;
+            if (canvas_col % stride != 0 || !ok[col])
+                continue;
+            const uchar others = cover[canvas_col] & ~(1 << camera);
+            if (!others)
+                continue;
+            const double intensity = (p[col][0] + p[col][1] + p[col][2]) / 3.0;
+            for (int j = 0; j < n; ++j)
+            {
+                if (others & (1 << j))
+                {
+                    statistics->stats.sum[camera * n + j] += intensity;
+                    ++statistics->stats.count[camera * n + j];
+                }
+            }
+        }
+    }
+}
+
+// Returns the first rows of buffer, allocated once for a full band of cols
+// and type so that the shorter last band does not reallocate it.
+inline cv::Mat GatherBandBuffer(cv::Mat& buffer, int rows, int cols, int type)
+{
+    buffer.create(kRemapGatherBandRows, cols, type);
+    return buffer.rowRange(0, rows);
+}
+
+// Warps src (CV_8UC3, of camera.src_size) into dst (CV_8UC3, map size)
+// through camera.map with bilinear cv::remap(), then applies tone. Pixels
+// outside the valid mask of camera are set to 0. The band buffers are taken
+// from scratch. If statistics is not NULL, the uncorrected intensities of the
+// pixels of camera index that overlap other cameras are added to
+// statistics->stats, which must have been Reset() for the frame; its
+// coverage must come from BuildCoverageMap() with the same cameras.
+inline void RemapGather(const cv::Mat& src, const GatherCamera& camera,
+                        const GatherTone& tone, GatherScratch* scratch,
+                        cv::Mat& dst, int index = 0,
+                        GatherStatistics* statistics = NULL)
+{
+    const cv::Mat& map = camera.map;
+    dst.create(map.size(), CV_8UC3);
+    const bool weighted = !tone.weights.empty();
+
+    for (int first = 0; first < map.rows; first += kRemapGatherBandRows)
+    {
+        const cv::Range rows(first, std::min(first + kRemapGatherBandRows, map.rows));
+        cv::Mat warped = GatherBandBuffer(scratch->warped, rows.size(), map.cols, CV_8UC3);
+        // Replicating the border reads the edge pixels for coordinates on the
+        // last row or column, as clamping would.
+        cv::remap(src, warped, map.rowRange(rows), cv::noArray(), cv::INTER_LINEAR,
+                  cv::BORDER_REPLICATE);
+
+        // Statistics are taken before correction, the gains are solved for
+        // the raw images.
+        if (statistics)
+            GatherBandStatistics(warped, camera.valid.rowRange(rows), rows.start,
+                                 index, camera.rect, statistics);
+
+        cv::Mat out = dst.rowRange(rows);
+        if (!weighted && !tone.lut)
+        {
+            // One pass straight to 8 bits, cv::transform saturates like
+            // convertTo.
+            if (tone.use_matrix)
+                cv::transform(warped, out, tone.matrix * tone.gain);
+            else
+                warped.convertTo(out, CV_8U, tone.gain);
+        }
+        else
+        {
+            cv::Mat corrected;
+            if (weighted)
+            {
+                // The spatial weights must reach the LUT on the raw pixel;
+                // without a LUT they commute with gain and matrix.
+                const cv::Mat w = tone.weights.rowRange(rows);
+                const cv::Mat planes[] = {w, w, w};
+                cv::Mat weights = GatherBandBuffer(scratch->weights, rows.size(),
+                                                   map.cols, CV_32FC3);
+                cv::merge(planes, 3, weights);
+                corrected = GatherBandBuffer(scratch->corrected, rows.size(),
+                                             map.cols, CV_32FC3);
+                if (tone.use_matrix && !tone.lut)
+                {
+                    cv::Mat pixels = GatherBandBuffer(scratch->pixels, rows.size(),
+                                                      map.cols, CV_32FC3);
+                    warped.convertTo(pixels, CV_32F);
+                    cv::transform(pixels, corrected, tone.matrix * tone.gain);
+                }
+                else
+                    warped.convertTo(corrected, CV_32F, tone.lut ? 1.0 : tone.gain);
+                cv::multiply(corrected, weights, corrected);
+            }
+
+            if (tone.lut)
+            {
+                for (int row = 0; row < out.rows; ++row)
+                {
+                    const cv::Vec3b* raw = warped.ptr<cv::Vec3b>(row);
+                    const cv::Vec3f* p = weighted ? corrected.ptr<cv::Vec3f>(row) : NULL;
+                    cv::Vec3b* o = out.ptr<cv::Vec3b>(row);
+                    for (int col = 0; col < out.cols; ++col)
+                    {
+                        float pixel[3], mapped[3];
+                        for (int c = 0; c < 3; ++c)
+                            pixel[c] = p ? p[col][c] : raw[col][c];
+                        tone.lut->Lookup(pixel, mapped);
+                        for (int c = 0; c < 3; ++c)
+                            o[col][c] = cv::saturate_cast<uchar>(mapped[c]);
+                    }
+                }
+            }
+            else
+            {
+                corrected.convertTo(out, CV_8U);
+            }
+        }
+        if (!camera.complete)
+            out.setTo(cv::Scalar::all(0), camera.invalid.rowRange(rows));
+    }
+}
+
+#endif  // REMAP_GATHER_H_
@@ -0,0 +1,211 @@
+// Offline export of long four-camera recordings, parallelized over GOPs.
+//
+// The recordings are cut at the keyframes of the first camera into segments
+// of at least min_segment_frames frames. Each worker thread decodes the four
+// cameras of one segment, composes and encodes it to its own raw stream, and
+// the segments are finally remuxed one after the other into a single MP4 with
+// convert2MP4(). Since every segment starts on a keyframe, a worker only has
+// to decode its own frames plus the lead-in GOP of the other cameras.
+
+#ifndef SEGMENT_EXPORT_H_
+#define SEGMENT_EXPORT_H_
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+#include "ffmpeg_audio_video_decoder.h"
+#include "keyframe_index.h"
+#include "Image2Video.h"
+
+// Composes one output frame from the four camera frames.
+typedef std::function<cv::Mat(std::vector<cv::Mat>& inputs)> ComposeFunction;
+
+// Creates the compose function of one worker. It is called once per worker,
+// so a non thread-safe Composition can be instantiated per worker.
+typedef std::function<ComposeFunction()> ComposeFactory;
+
+struct SegmentExportOptions
+{
+    // Number of worker threads, 0 uses one per core.
+    int num_workers;
+    // Consecutive GOPs are merged until a segment has at least this many
+    // frames, so that short GOPs do not multiply the encoder start-up cost.
+    int min_segment_frames;
+    // Directory for the intermediate segment streams, with trailing slash.
+    std::string temp_dir;
+    cv::Size output_size;
+    // Encoder settings of the segments. Each worker encodes on one thread
+    // and without B-frames, whatever thread_count and max_b_frames say. The
+    // audio of audio_source is added once, when the segments are remuxed.
+    FFMPEGVideoEncoderOptions encoder_options;
+
+    SegmentExportOptions()
+    {
+        num_workers = 0;
+        min_segment_frames = 250;
+        output_size = cv::Size(600, 600);
+    }
+};
+
+// Splits the frames [0, index.frame_count()) into segments starting on
+// clean keyframes. Each pair is [first frame, end frame).
+inline std::vector<std::pair<int, int>> planSegments(const KeyframeIndex& index,
+                                                     int min_segment_frames)
+{
+    std::vector<std::pair<int, int>> segments;
+    const std::vector<KeyframeEntry>& keys = index.entries();
+    int start = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (keys[i].clean && keys[i].frame - start >= min_segment_frames)
+        {
+            segments.push_back(std::make_pair(start, keys[i].frame));
+            start = keys[i].frame;
+        }
+    }
+    if (start < index.frame_count())
+        segments.push_back(std::make_pair(start, index.frame_count()));
+    return segments;
+}
+
+// Decodes, composes and encodes the frames [first, end) of the recordings
+// into output_file, using the decoders of the calling worker.
+inline bool exportSegment(std::vector<FFMPEGVideoDecoder>& decoders,
+                          ComposeFunction& compose, int first, int end,
+                          cv::Size output_size, const char* output_file,
+                          const FFMPEGVideoEncoderOptions& encoder_options =
+                              FFMPEGVideoEncoderOptions())
+{
+    for (size_t i = 0; i < decoders.size(); ++i)
+    {
+        if (!decoders[i].SeekIndexedFrame(first))
+        {
+            printf("error: cannot seek camera %d to frame %d\n", (int)i, first);
+            return false;
+        }
+    }
+
+    std::vector<cv::Mat> inputs(decoders.size());
+    int frame = first;
+    // Returning false from the source also ends the segment normally, a
+    // decoding error is told apart here.
+    bool failed = false;
+    bool ok = videoEncoding([&](cv::Mat& output) {
+        if (frame >= end)
+            return false;
+        for (size_t i = 0; i < decoders.size(); ++i)
+        {
+            // The seek leaves the first frame decoded.
+            if (frame > first)
+            {
+                decoders[i].MarkFrameConsumed();
+                if (!decoders[i].DecodeLoop())
+                    failed = true;
+            }
+            if (failed || !decoders[i].convert_avframe_to_mat(&inputs[i]))
+            {
+                printf("error: cannot decode camera %d at frame %d\n", (int)i, frame);
+                failed = true;
+                return false;
+            }
+        }
+        output = compose(inputs);
+        ++frame;
+        return true;
+    }, output_size, output_file, encoder_options);
+    return !failed && ok;
+}
+
+// Exports the composition of the recordings in camera_files to output_video.
+// FFMPEGDecoder::InitFFPMEG() must have been called before.
+inline bool exportRecording(const std::vector<std::string>& camera_files,
+                            const ComposeFactory& compose_factory,
+                            const SegmentExportOptions& options,
+                            const char* output_video)
+{
+    // av_register_all() is not thread-safe, run it before the workers do.
+    av_register_all();
+
+    // Build the sidecar indices up front, so that the workers only read them.
+    KeyframeIndex index;
+    for (size_t i = camera_files.size(); i-- > 0;)
+        if (!index.LoadOrBuild(camera_files[i].c_str()))
+            return false;
+    if (camera_files.empty())
+        return false;
+    const std::vector<std::pair<int, int>> segments =
+        planSegments(index, options.min_segment_frames);
+
+    std::vector<std::string> segment_files(segments.size());
+    for (size_t s = 0; s < segments.size(); ++s)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "segment_%05d.h264", (int)s);
+        segment_files[s] = options.temp_dir + name;
+    }
+
+    int num_workers = options.num_workers;
+    if (num_workers <= 0)
+        num_workers = std::max(1, (int)std::thread::hardware_concurrency());
+    num_workers = std::min(num_workers, (int)segments.size());
+
+    std::atomic<int> next_segment(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < num_workers; ++w)
+    {
+        workers.push_back(std::thread([&]() {
+            // Parallelism comes from the segments, decode each stream on a
+            // single thread.
+            FFMPEGDecoderOptions decoder_options;
+            decoder_options.thread_count = 1;
+            // Likewise for the encoder. convert2MP4() rebuilds timestamps in
+            // decode order, which B-frames would scramble.
+            FFMPEGVideoEncoderOptions encoder_options = options.encoder_options;
+            encoder_options.thread_count = 1;
+            encoder_options.max_b_frames = 0;
+            // A raw segment stream has no room for audio.
+            encoder_options.audio_source.clear();
+            std::vector<FFMPEGVideoDecoder> decoders(camera_files.size());
+            for (size_t i = 0; i < camera_files.size(); ++i)
+            {
+                if (!decoders[i].Open(camera_files[i].c_str(), 1, "", decoder_options) ||
+                    decoders[i].keyframe_index().empty())
+                {
+                    failed = true;
+                    return;
+                }
+            }
+            ComposeFunction compose = compose_factory();
+
+            int s;
+            while (!failed && (s = next_segment++) < (int)segments.size())
+            {
+                printf("Exporting segment %d: frames %d to %d...\n",
+                       s, segments[s].first, segments[s].second);
+                if (!exportSegment(decoders, compose, segments[s].first,
+                                   segments[s].second, options.output_size,
+                                   segment_files[s].c_str(), encoder_options))
+                    failed = true;
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); ++w)
+        workers[w].join();
+
+    bool ok = !failed && convert2MP4(segment_files, output_video,
+                                     options.encoder_options.audio_source,
+                                     options.encoder_options.audio_offset);
+    for (size_t s = 0; s < segment_files.size(); ++s)
+        remove(segment_files[s].c_str());
+    return ok;
+}
+
+#endif  // SEGMENT_EXPORT_H_
@@ -11,8 +11,11 @@ struct ImageStatistics;
 // function of a pair of affine transformations applied to each of
 // them.
 //
-// This cost functor is numerically differentiated and used to match a
-// set of color distributions using Ceres Solver.
+// This cost functor is used to match a set of color distributions
+// using Ceres Solver. Create() differentiates it numerically, as
+// ComputeConsistentColorTransforms does; CreateAutoDiff()
+// differentiates the templated operator() automatically, as
+// TemporalColorCorrector does.
 class SymmetrizedKullbackLeiblerCost {
  public:
   // Symmetrized Kullback-Leibler divergence between a pair of
@@ -57,11 +60,37 @@ class SymmetrizedKullbackLeiblerCost {
                   const double* transform1,
                   double* residuals) const;
 
+  // Same residuals for any scalar type, used for automatic
+  // differentiation. B_i^{-1} is computed in closed form from the
+  // adjugate of B_i.
+  template <typename T>
+  bool operator()(const T* transform0,
+                  const T* transform1,
+                  T* residuals) const;
+
   // Create a numerically differentiated CostFunction object using
   // this functor.
   static ceres::CostFunction* Create(const ImageStatistics& image0,
                                      const ImageStatistics& image1);
 
+  // Create an automatically differentiated CostFunction object using
+  // this functor. The Cholesky factors are computed once by Init, as
+  // for Create. Returns nullptr if either covariance is rank deficient.
+  static ceres::CostFunction* CreateAutoDiff(const ImageStatistics& image0,
+                                             const ImageStatistics& image1);
+
+  // Same as above, also returning the functor, owned by the returned
+  // CostFunction, so that it can be updated with new statistics while
+  // the cost function stays in a ceres::Problem.
+  static ceres::CostFunction* CreateAutoDiff(
+      const ImageStatistics& image0, const ImageStatistics& image1,
+      SymmetrizedKullbackLeiblerCost** functor);
+
+  // Replaces the statistics the functor was initialized with. Returns
+  // false, leaving the functor unchanged, if either covariance is rank
+  // deficient.
+  bool Update(const ImageStatistics& image0, const ImageStatistics& image1);
+
  private:
   // Private constructor to ensure that this class can only be
   // instantiated by calling the factory Create.
@@ -80,10 +109,126 @@ class SymmetrizedKullbackLeiblerCost {
   // deficient and the Cholesky factorization failed.
   bool Init(const ImageStatistics& image0, const ImageStatistics& image1);
 
+  // Computes B = A * L where A is the 3x3 part of the column major 3x4
+  // transform and L a column major lower triangular matrix.
+  template <typename T>
+  static void TransformCholeskyFactor(const T* transform, const double* l,
+                                      T* b);
+
+  // Computes the inverse of the column major 3x3 matrix m as its
+  // adjugate divided by its determinant.
+  template <typename T>
+  static void Invert3x3(const T* m, T* inverse);
+
+  // Computes the column major product x = a * b of 3x3 matrices.
+  template <typename T>
+  static void Multiply3x3(const T* a, const T* b, T* x);
+
   double mu0_[3];
   double mu1_[3];
   double l0_[3 * 3];
   double l1_[3 * 3];
 };
 
+template <typename T>
+void SymmetrizedKullbackLeiblerCost::TransformCholeskyFactor(
+    const T* transform, const double* l, T* b) {
+  for (int c = 0; c < 3; ++c) {
+    for (int r = 0; r < 3; ++r) {
+      T sum = T(0.0);
+      for (int k = c; k < 3; ++k) {
+        sum += transform[k * 3 + r] * l[c * 3 + k];
+      }
+      b[c * 3 + r] = sum;
+    }
+  }
+}
+
+template <typename T>
+void SymmetrizedKullbackLeiblerCost::Invert3x3(const T* m, T* inverse) {
+  // m(r, c) = m[c * 3 + r]
+  const T c00 = m[4] * m[8] - m[7] * m[5];
+  const T c01 = m[7] * m[2] - m[1] * m[8];
+  const T c02 = m[1] * m[5] - m[4] * m[2];
+  const T det = m[0] * c00 + m[3] * c01 + m[6] * c02;
+  inverse[0] = c00 / det;
+  inverse[1] = c01 / det;
+  inverse[2] = c02 / det;
+  inverse[3] = (m[6] * m[5] - m[3] * m[8]) / det;
+  inverse[4] = (m[0] * m[8] - m[6] * m[2]) / det;
+  inverse[5] = (m[3] * m[2] - m[0] * m[5]) / det;
+  inverse[6] = (m[3] * m[7] - m[6] * m[4]) / det;
+  inverse[7] = (m[6] * m[1] - m[0] * m[7]) / det;
+  inverse[8] = (m[0] * m[4] - m[3] * m[1]) / det;
+}
+
+template <typename T>
+void SymmetrizedKullbackLeiblerCost::Multiply3x3(const T* a, const T* b, T* x) {
+  for (int c = 0; c < 3; ++c) {
+    for (int r = 0; r < 3; ++r) {
+      x[c * 3 + r] = a[r] * b[c * 3] + a[3 + r] * b[c * 3 + 1] +
+                     a[6 + r] * b[c * 3 + 2];
+    }
+  }
+}
+
+template <typename T>
+bool SymmetrizedKullbackLeiblerCost::operator()(const T* transform0,
+                                                const T* transform1,
+                                                T* residuals) const {
+  T b0[9], b1[9], b0_inverse[9], b1_inverse[9];
+  TransformCholeskyFactor(transform0, l0_, b0);
+  TransformCholeskyFactor(transform1, l1_, b1);
+  Invert3x3(b0, b0_inverse);
+  Invert3x3(b1, b1_inverse);
+
+  Multiply3x3(b0_inverse, b1, residuals);
+  Multiply3x3(b1_inverse, b0, residuals + 9);
+
+  // m_0 - m_1 with m_i = A_i * mu_i + b_i.
+  T dm[3];
+  for (int r = 0; r < 3; ++r) {
+    dm[r] = transform0[9 + r] - transform1[9 + r];
+    for (int c = 0; c < 3; ++c) {
+      dm[r] += transform0[c * 3 + r] * mu0_[c] - transform1[c * 3 + r] * mu1_[c];
+    }
+  }
+  for (int r = 0; r < 3; ++r) {
+    residuals[18 + r] = b0_inverse[r] * dm[0] + b0_inverse[3 + r] * dm[1] +
+                        b0_inverse[6 + r] * dm[2];
+    residuals[21 + r] = b1_inverse[r] * dm[0] + b1_inverse[3 + r] * dm[1] +
+                        b1_inverse[6 + r] * dm[2];
+  }
+  return true;
+}
+
+inline ceres::CostFunction* SymmetrizedKullbackLeiblerCost::CreateAutoDiff(
+    const ImageStatistics& image0, const ImageStatistics& image1) {
+  SymmetrizedKullbackLeiblerCost* functor = nullptr;
+  return CreateAutoDiff(image0, image1, &functor);
+}
+
+inline ceres::CostFunction* SymmetrizedKullbackLeiblerCost::CreateAutoDiff(
+    const ImageStatistics& image0, const ImageStatistics& image1,
+    SymmetrizedKullbackLeiblerCost** functor) {
+  *functor = new SymmetrizedKullbackLeiblerCost;
+  if (!(*functor)->Init(image0, image1)) {
+    delete *functor;
+    *functor = nullptr;
+    return nullptr;
+  }
+  return new ceres::AutoDiffCostFunction<SymmetrizedKullbackLeiblerCost,
+                                         24, 12, 12>(*functor);
+}
+
+inline bool SymmetrizedKullbackLeiblerCost::Update(
+    const ImageStatistics& image0, const ImageStatistics& image1) {
+  SymmetrizedKullbackLeiblerCost updated;
+  if (!updated.Init(image0, image1)) {
+    return false;
+  }
+  *this = updated;
+  return true;
+}
+
 #endif  // SAURON_COLOR_TRANSFORM_SYMMETRIZED_KULLBACK_LEIBLER_COST_H_
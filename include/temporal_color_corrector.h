@@ -0,0 +1,261 @@
+#ifndef SAURON_COLOR_TRANSFORM_TEMPORAL_COLOR_CORRECTOR_H_
+#define SAURON_COLOR_TRANSFORM_TEMPORAL_COLOR_CORRECTOR_H_
+
+#include <math.h>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "ceres/ceres.h"
+#include "affine_transform_regularization_cost.h"
+#include "color_transform.h"
+#include "symmetrized_kullback_leibler_cost.h"
+
+struct TemporalColorOptions {
+  // Weight of the statistics of a new frame in their exponential moving
+  // average. 1 disables smoothing.
+  double smoothing = 0.2;
+
+  // The transforms are re-estimated only once a mean or covariance entry
+  // of the smoothed statistics has moved by more than drift_threshold,
+  // in standard deviations, since the last solve.
+  double drift_threshold = 0.05;
+
+  // Limits of a single solve. The previous transforms are a good
+  // starting point, so a few iterations are enough.
+  int max_num_iterations = 10;
+  double max_solver_time = 0.002;
+};
+
+// Color correction of a video: the transforms of ColorTransformer, kept
+// consistent across frames.
+//
+// The Ceres problem is built once, with one automatically
+// differentiated SymmetrizedKullbackLeiblerCost per constraint and the
+// identity regularization of every transform. For each frame the
+// statistics are blended into their moving average and, only if they
+// drifted, the cost functors are updated in place and the problem is
+// solved again starting from the previous transforms. Most frames cost
+// a few hundred operations; a solve is a couple of iterations.
+//
+// The statistics are typically computed with ComputeImageStatistics()
+// or ColorMomentIntegral, see color_statistics.h.
+class TemporalColorCorrector {
+ public:
+  TemporalColorCorrector() : num_images_(0), num_solves_(0) {}
+
+  // Starts tracking num_images images. options.reference_image_id and
+  // options.regularization are used as in ColorTransformer. With no
+  // reference image the transforms are only held by the regularization.
+  void Reset(int num_images, const ColorTransformOptions& options,
+             const TemporalColorOptions& temporal = TemporalColorOptions());
+
+  // Adds the statistics of a frame, given as in
+  // ColorTransformer::ComputeConsistentColorTransforms: one pair per
+  // constraint, the index of each ImageStatistics being its image.
+  // The problem is rebuilt if the constraints are not those of the
+  // previous frame. Returns true if the transforms were re-estimated,
+  // false without any change if a constraint refers to an image outside
+  // [0, num_images), which includes any constraint before Reset().
+  bool Update(const std::vector<std::pair<ImageStatistics, ImageStatistics>>&
+                  constraints);
+
+  // Transform of each image, identity until the first solve. Its offset
+  // is in the units of the statistics: with statistics scaled by
+  // 1 / 255, pass the default value_scale of 255 to ApplyColorTransform
+  // or ColorOp::Transform.
+  const std::vector<ColorTransform<double>>& transforms() const {
+    return transforms_;
+  }
+
+  int num_solves() const { return num_solves_; }
+
+ private:
+  // Builds the problem over constraints, which become the smoothed
+  // statistics. Returns false, keeping the current problem, if an image
+  // index is out of range.
+  bool Build(const std::vector<std::pair<ImageStatistics, ImageStatistics>>&
+                 constraints);
+
+  // True if constraints relate the same images as the problem.
+  bool SameConstraints(const std::vector<
+                       std::pair<ImageStatistics, ImageStatistics>>&
+                           constraints) const;
+
+  // Largest change from a to b of a mean or covariance entry, in units
+  // of the standard deviations of a.
+  static double Drift(const ImageStatistics& a, const ImageStatistics& b);
+
+  // stats = (1 - weight) * stats + weight * sample.
+  static void Blend(const ImageStatistics& sample, double weight,
+                    ImageStatistics* stats);
+
+  void Solve();
+
+  ColorTransformOptions options_;
+  TemporalColorOptions temporal_;
+  int num_images_;
+  int num_solves_;
+
+  // Parameter blocks of problem_, never reallocated while it exists.
+  std::vector<ColorTransform<double>> transforms_;
+  std::unique_ptr<ceres::Problem> problem_;
+  // Per constraint: its functor (owned by problem_, nullptr if the pair
+  // was rank deficient when built), smoothed and last solved statistics.
+  std::vector<SymmetrizedKullbackLeiblerCost*> costs_;
+  std::vector<std::pair<ImageStatistics, ImageStatistics>> smoothed_;
+  std::vector<std::pair<ImageStatistics, ImageStatistics>> solved_;
+};
+
+inline void TemporalColorCorrector::Reset(int num_images,
+                                          const ColorTransformOptions& options,
+                                          const TemporalColorOptions& temporal) {
+  options_ = options;
+  temporal_ = temporal;
+  num_images_ = num_images;
+  num_solves_ = 0;
+  problem_.reset();
+  costs_.clear();
+  smoothed_.clear();
+  solved_.clear();
+  const ColorTransform<double> identity = {{1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0}};
+  transforms_.assign(num_images, identity);
+}
+
+inline bool TemporalColorCorrector::Update(
+    const std::vector<std::pair<ImageStatistics, ImageStatistics>>&
+        constraints) {
+  if (!problem_ || !SameConstraints(constraints)) {
+    if (!Build(constraints)) {
+      return false;
+    }
+    Solve();
+    return true;
+  }
+
+  double drift = 0.0;
+  for (size_t i = 0; i < constraints.size(); ++i) {
+    Blend(constraints[i].first, temporal_.smoothing, &smoothed_[i].first);
+    Blend(constraints[i].second, temporal_.smoothing, &smoothed_[i].second);
+    drift = std::max(drift, Drift(solved_[i].first, smoothed_[i].first));
+    drift = std::max(drift, Drift(solved_[i].second, smoothed_[i].second));
+  }
+  if (drift <= temporal_.drift_threshold) {
+    return false;
+  }
+
+  for (size_t i = 0; i < costs_.size(); ++i) {
+    // A pair that became rank deficient keeps its previous statistics.
+    if (costs_[i] &&
+        costs_[i]->Update(smoothed_[i].first, smoothed_[i].second)) {
+      solved_[i] = smoothed_[i];
+    }
+  }
+  Solve();
+  return true;
+}
+
+inline bool TemporalColorCorrector::Build(
+    const std::vector<std::pair<ImageStatistics, ImageStatistics>>&
+        constraints) {
+  if (num_images_ <= 0) {
+    return false;
+  }
+  for (size_t i = 0; i < constraints.size(); ++i) {
+    const int index0 = constraints[i].first.index;
+    const int index1 = constraints[i].second.index;
+    if (index0 < 0 || index0 >= num_images_ || index1 < 0 ||
+        index1 >= num_images_) {
+      return false;
+    }
+  }
+
+  problem_.reset(new ceres::Problem);
+  costs_.assign(constraints.size(), nullptr);
+  smoothed_ = constraints;
+  solved_ = constraints;
+
+  for (size_t i = 0; i < constraints.size(); ++i) {
+    const ImageStatistics& image0 = constraints[i].first;
+    const ImageStatistics& image1 = constraints[i].second;
+    ceres::CostFunction* cost = SymmetrizedKullbackLeiblerCost::CreateAutoDiff(
+        image0, image1, &costs_[i]);
+    if (cost == nullptr) {
+      continue;
+    }
+    problem_->AddResidualBlock(cost, nullptr,
+                               transforms_[image0.index].data,
+                               transforms_[image1.index].data);
+  }
+
+  for (int i = 0; i < num_images_; ++i) {
+    problem_->AddResidualBlock(
+        AffineTransformRegularizationCost::Create(),
+        new ceres::ScaledLoss(nullptr, options_.regularization,
+                              ceres::TAKE_OWNERSHIP),
+        transforms_[i].data);
+  }
+  const int reference = options_.reference_image_id;
+  if (reference >= 0 && reference < num_images_) {
+    problem_->SetParameterBlockConstant(transforms_[reference].data);
+  }
+  return true;
+}
+
+inline bool TemporalColorCorrector::SameConstraints(
+    const std::vector<std::pair<ImageStatistics, ImageStatistics>>&
+        constraints) const {
+  if (constraints.size() != smoothed_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < constraints.size(); ++i) {
+    if (constraints[i].first.index != smoothed_[i].first.index ||
+        constraints[i].second.index != smoothed_[i].second.index) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline double TemporalColorCorrector::Drift(const ImageStatistics& a,
+                                            const ImageStatistics& b) {
+  double sigma[3];
+  for (int i = 0; i < 3; ++i) {
+    sigma[i] = sqrt(std::max(a.covariance[i * 3 + i], 1e-12));
+  }
+  double drift = 0.0;
+  for (int r = 0; r < 3; ++r) {
+    drift = std::max(drift, fabs(b.mean[r] - a.mean[r]) / sigma[r]);
+    for (int c = 0; c <= r; ++c) {
+      const double change = fabs(b.covariance[c * 3 + r] -
+                                 a.covariance[c * 3 + r]);
+      drift = std::max(drift, change / (sigma[r] * sigma[c]));
+    }
+  }
+  return drift;
+}
+
+inline void TemporalColorCorrector::Blend(const ImageStatistics& sample,
+                                          double weight,
+                                          ImageStatistics* stats) {
+  for (int i = 0; i < 3; ++i) {
+    stats->mean[i] += weight * (sample.mean[i] - stats->mean[i]);
+  }
+  for (int i = 0; i < 9; ++i) {
+    stats->covariance[i] += weight * (sample.covariance[i] - stats->covariance[i]);
+  }
+}
+
+inline void TemporalColorCorrector::Solve() {
+  ceres::Solver::Options options;
+  options.linear_solver_type = ceres::DENSE_QR;
+  options.max_num_iterations = temporal_.max_num_iterations;
+  options.max_solver_time_in_seconds = temporal_.max_solver_time;
+  options.logging_type = ceres::SILENT;
+  ceres::Solver::Summary summary;
+  ceres::Solve(options, problem_.get(), &summary);
+  ++num_solves_;
+}
+
+#endif  // SAURON_COLOR_TRANSFORM_TEMPORAL_COLOR_CORRECTOR_H_
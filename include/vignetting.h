@@ -0,0 +1,151 @@
+// Radial vignetting correction of the fisheye cameras.
+//
+// The falloff of a camera is modeled as
+//   V(r) = 1 + a1 r^2 + a2 r^4 + a3 r^6
+// where r is the distance to the principal point divided by the half
+// diagonal of the image. The model is fitted once per camera from calibration
+// images of an evenly lit scene, then turned into a weight 1 / V(r) for every
+// pixel of the compose tables by following the remap to the source pixel.
+// Multiplied into the GatherTone weights of RemapGather() (with the gain map,
+// if any), the correction costs nothing more per frame.
+
+#ifndef VIGNETTING_H_
+#define VIGNETTING_H_
+
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+struct VignettingModel
+{
+    cv::Point2d center;
+    // Half diagonal of the image, the unit of r.
+    double radius;
+    double a1, a2, a3;
+
+    VignettingModel() : radius(1.0), a1(0.0), a2(0.0), a3(0.0) {}
+
+    // Model of an image of image_size centered on the principal point of K.
+    VignettingModel(const cv::Mat& K, cv::Size image_size)
+        : a1(0.0), a2(0.0), a3(0.0)
+    {
+        center = cv::Point2d(K.at<double>(0, 2), K.at<double>(1, 2));
+        radius = 0.5 * sqrt(double(image_size.width) * image_size.width +
+                            double(image_size.height) * image_size.height);
+    }
+
+    // Relative brightness at pixel (x, y).
+    double falloff(double x, double y) const
+    {
+        const double dx = (x - center.x) / radius;
+        const double dy = (y - center.y) / radius;
+        const double r2 = dx * dx + dy * dy;
+        return 1.0 + r2 * (a1 + r2 * (a2 + r2 * a3));
+    }
+
+    void write(cv::FileStorage& fs, const std::string& name) const
+    {
+        fs << name << "{" << "center" << center << "radius" << radius
+           << "a1" << a1 << "a2" << a2 << "a3" << a3 << "}";
+    }
+
+    void read(const cv::FileNode& node)
+    {
+        node["center"] >> center;
+        node["radius"] >> radius;
+        node["a1"] >> a1;
+        node["a2"] >> a2;
+        node["a3"] >> a3;
+    }
+};
+
+// Fits the coefficients of model, whose center and radius must be set, to
+// calibration images (CV_8UC3) of a uniform, evenly lit surface. Pixels are
+// sampled every stride pixels; dark or saturated ones are ignored. Returns
+// false if too few pixels are usable.
+inline bool FitVignetting(const std::vector<cv::Mat>& images, int stride,
+                          VignettingModel* model)
+{
+    // Linear least squares on I = c0 + c1 r^2 + c2 r^4 + c3 r^6, then
+    // a_k = c_k / c0.
+    cv::Matx44d AtA = cv::Matx44d::zeros();
+    cv::Vec4d Atb(0, 0, 0, 0);
+    int samples = 0;
+    stride = std::max(stride, 1);
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        const cv::Mat& image = images[i];
+        for (int row = 0; row < image.rows; row += stride)
+        {
+            const cv::Vec3b* pixels = image.ptr<cv::Vec3b>(row);
+            for (int col = 0; col < image.cols; col += stride)
+            {
+                const double intensity = (pixels[col][0] + pixels[col][1] + pixels[col][2]) / 3.0;
+                if (intensity < 10.0 || intensity > 245.0)
+                    continue;
+                const double dx = (col - model->center.x) / model->radius;
+                const double dy = (row - model->center.y) / model->radius;
+                const double r2 = dx * dx + dy * dy;
+                const cv::Vec4d a(1.0, r2, r2 * r2, r2 * r2 * r2);
+                AtA += a * a.t();
+                Atb += intensity * a;
+                ++samples;
+            }
+        }
+    }
+    if (samples < 16)
+        return false;
+
+    cv::Vec4d c;
+    if (!cv::solve(AtA, Atb, c, cv::DECOMP_CHOLESKY) || c[0] <= 0.0)
+        return false;
+    model->a1 = c[1] / c[0];
+    model->a2 = c[2] / c[0];
+    model->a3 = c[3] / c[0];
+    return true;
+}
+
+// Multiplies weights (CV_32FC1, created with 1 if empty) by the vignetting
+// correction 1 / V of the source pixel of each entry of map (CV_32FC2, pixel
+// coordinates in the camera image the model was fitted on). Unmapped
+// entries, with negative coordinates, are left unchanged. The falloff is
+// clamped to min_falloff to bound the amplification of the image corners.
+inline void FoldVignetting(const VignettingModel& model, const cv::Mat& map,
+                           cv::Mat* weights, double min_falloff = 0.25)
+{
+    if (weights->empty())
+    {
+        weights->create(map.size(), CV_32FC1);
+        weights->setTo(1.0f);
+    }
+    for (int row = 0; row < map.rows; ++row)
+    {
+        const cv::Vec2f* coords = map.ptr<cv::Vec2f>(row);
+        float* weight = weights->ptr<float>(row);
+        for (int col = 0; col < map.cols; ++col)
+        {
+            const float x = coords[col][0];
+            const float y = coords[col][1];
+            if (!(x >= 0 && y >= 0))
+                continue;
+            const double falloff = std::max(min_falloff, model.falloff(x, y));
+            weight[col] = static_cast<float>(weight[col] / falloff);
+        }
+    }
+}
+
+// Same as above for separate CV_32FC1 maps, as returned by
+// Calibrate::getRemapX() and getRemapY().
+inline void FoldVignetting(const VignettingModel& model, const cv::Mat& map_x,
+                           const cv::Mat& map_y, cv::Mat* weights,
+                           double min_falloff = 0.25)
+{
+    cv::Mat map;
+    cv::merge(std::vector<cv::Mat>{map_x, map_y}, map);
+    FoldVignetting(model, map, weights, min_falloff);
+}
+
+#endif  // VIGNETTING_H_